@@ -0,0 +1,443 @@
+// Micro-benchmarks of the building blocks of the force simulation: the Vector
+// operators by dimension, the solvers by system size, and the pair and link
+// kernels. Every case runs batches for a fixed time, several times over, and reports
+// its median throughput, which a stray slow or fast repeat does not move.
+//
+// With a baseline file every case is compared to its recorded throughput, and the
+// run fails when one falls more than the tolerance below it. Baselines depend on
+// the machine, so record them on the one that runs the comparison.
+//
+// Usage: MicroBenchmark [--baseline file] [--record] [--tolerance 0.15] [--filter text]
+//                       [--repeats 9] [--seconds 0.25]
+// Exit code: 0 when no case regressed, 1 when one did, 2 on bad arguments or when
+// the baseline is missing or lacks a case that ran.
+
+#include "Arena.h"
+#include "Kernels.h"
+#include "Solver.h"
+#include "StopWatch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+struct Case
+{
+  std::string Name;
+  const char* Unit;
+  std::function<double()> Batch;  // returns the number of operations done
+};
+
+// Results go here so that the compiler cannot drop the work
+static volatile double Sink;
+
+static const int VectorCount = 1024;
+
+template<int Dim>
+static void AddVectorCases(std::vector<Case>& cases)
+{
+  using MyVector = Vector<double, Dim>;
+  auto a = std::make_shared<std::vector<MyVector>>(VectorCount);
+  auto b = std::make_shared<std::vector<MyVector>>(VectorCount);
+  std::mt19937 random(Dim);
+  std::uniform_real_distribution<double> coordinate(-1, 1);
+  for (auto& v : *b)
+  {
+    for (auto& x : v.Data)
+      x = coordinate(random);
+  }
+  std::string prefix = "Vector" + std::to_string(Dim) + ".";
+
+  cases.push_back({ prefix + "Add", "vectors/s", [a, b]()
+  {
+    for (int i = 0; i < VectorCount; i++)
+      (*a)[i] += (*b)[i];
+    return double(VectorCount);
+  } });
+  // A temporary from a binary operator, as in the force kernels
+  cases.push_back({ prefix + "AddScaled", "vectors/s", [a, b]()
+  {
+    for (int i = 0; i < VectorCount; i++)
+      (*a)[i] -= (*b)[i] * 0.5;
+    return double(VectorCount);
+  } });
+  // Compound operators chained through the references they return
+  cases.push_back({ prefix + "Chain", "vectors/s", [a, b]()
+  {
+    for (int i = 0; i < VectorCount; i++)
+      ((*a)[i] += (*b)[i]) *= 0.5;
+    return double(VectorCount);
+  } });
+  cases.push_back({ prefix + "Length", "vectors/s", [b]()
+  {
+    double sum = 0;
+    for (int i = 0; i < VectorCount; i++)
+      sum += (*b)[i].Length();
+    Sink = sum;
+    return double(VectorCount);
+  } });
+}
+
+// Harmonic oscillators: pairs of (x, v) with x' = v and v' = -x
+static void Oscillators(const double* y, double* fy, int n)
+{
+  for (int i = 0; i < n; i += 2)
+  {
+    fy[i] = y[i + 1];
+    fy[i + 1] = -y[i];
+  }
+}
+
+// Rotations: pairs of (x, v) with x' = w v and v' = -w x, where w is 1, 2 or 4 by
+// pair. Their size is constant, so the block solver puts every pair on the same
+// step level each step.
+static double RotationRate(int pair)
+{
+  return double(1 << (pair % 3));
+}
+
+static void Rotations(const double* y, double* fy, const int* active, int activeCount)
+{
+  for (int a = 0; a < activeCount; a++)
+  {
+    int i = active[a] * 2;
+    double w = RotationRate(active[a]);
+    fy[i] = w * y[i + 1];
+    fy[i + 1] = -w * y[i];
+  }
+}
+
+// Opens up the solver's Distance
+class DistanceProbe : public EulerSolver<double>
+{
+public:
+  using BasicSolver<double>::Distance;
+};
+
+template<typename Solver>
+static Case SolverCase(const std::string& name, int n)
+{
+  auto arena = std::make_shared<Arena>();
+  auto solver = std::make_shared<Solver>();
+  double* y = arena->Allocate<double>(n);
+  for (int i = 0; i < n; i++)
+    y[i] = i % 2 ? 0 : 1;
+  solver->Initialize(*arena, n, y, [n](const double* y, double* fy) { Oscillators(y, fy, n); });
+  // An accuracy that every trial step passes keeps the work per step fixed
+  return { name + "/" + std::to_string(n), "values/s", [arena, solver, n]()
+  {
+    solver->Step(1e-3, 1e300);
+    return double(n);
+  } };
+}
+
+// Block Euler steps with the pairs spread over levels 0, 2 and 4: a trial step's
+// derivative changes by dt w^2 per pair, and the accuracy sits between the changes
+// for w = 1 and w = 2, with each fourfold change costing two levels
+static Case BlockSolverCase(int n)
+{
+  const int maxLevel = 4;
+  const double dt = 1e-3;
+  auto arena = std::make_shared<Arena>();
+  auto solver = std::make_shared<BlockEulerSolver<double>>();
+  auto all = std::make_shared<std::vector<int>>(n / 2);
+  for (int b = 0; b < n / 2; b++)
+    (*all)[b] = b;
+  double* y = arena->Allocate<double>(n);
+  for (int i = 0; i < n; i++)
+    y[i] = i % 2 ? 0 : 1;
+  solver->Initialize(*arena, n, y, [all, n](const double* y, double* fy) { Rotations(y, fy, all->data(), n / 2); }, 2,
+    [](const double* y, double* fy, const int* active, int activeCount) { Rotations(y, fy, active, activeCount); });
+  solver->SetMaxLevel(maxLevel);
+  double accuracy = 1.5 * dt * sqrt(double(n / 2));
+  return { "BlockEulerSolver/" + std::to_string(n), "values/s", [arena, solver, all, n, dt, accuracy]()
+  {
+    solver->Step(dt, accuracy);
+    return double(n);
+  } };
+}
+
+static void AddSolverCases(std::vector<Case>& cases)
+{
+  for (int n : { 1024, 65536 })
+  {
+    auto arena = std::make_shared<Arena>();
+    auto probe = std::make_shared<DistanceProbe>();
+    double* x1 = arena->Allocate<double>(n);
+    double* x2 = arena->Allocate<double>(n);
+    for (int i = 0; i < n; i++)
+    {
+      x1[i] = i;
+      x2[i] = i + 0.5;
+    }
+    probe->Initialize(*arena, n, x1, [](const double*, double*) {});
+    cases.push_back({ "Distance/" + std::to_string(n), "values/s", [arena, probe, x1, x2, n]()
+    {
+      Sink = probe->Distance(x1, x2);
+      return double(n);
+    } });
+    cases.push_back(SolverCase<EulerSolver<double>>("EulerSolver", n));
+    cases.push_back(SolverCase<RungeKuttaSolver<double>>("RungeKuttaSolver", n));
+    cases.push_back(BlockSolverCase(n));
+  }
+}
+
+template<int Dim>
+struct KernelData
+{
+  std::vector<Particle<double, Dim>> Inputs;
+  std::vector<Particle<double, Dim>> Outputs;
+  std::vector<ParticleInfo> Infos;
+  std::vector<LinkInfo> Links;
+  // Links incident to each particle: ParticleLinks[ParticleLinkOffsets[i] .. ParticleLinkOffsets[i + 1])
+  std::vector<int> ParticleLinkOffsets;
+  std::vector<int> ParticleLinks;
+  Parameters Params;
+
+  // Random positions and links, with every particle linked to the first few so
+  // that the degrees are heavy-tailed
+  KernelData(int particleCount, int linkCount)
+    : Inputs(particleCount), Outputs(particleCount), Infos(particleCount), ParticleLinkOffsets(particleCount + 1)
+  {
+    std::mt19937 random(particleCount);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    for (int i = 0; i < particleCount; i++)
+    {
+      for (auto& x : Inputs[i].Position.Data)
+        x = coordinate(random);
+      Infos[i].Mass = 1;
+      Infos[i].Fixed = false;
+    }
+    for (int k = 0; k < linkCount; k++)
+    {
+      int a = int(random() % particleCount);
+      int b = k % 2 ? int(random() % 8) : int(random() % particleCount);
+      if (a != b)
+        Links.push_back({ a, b, 1 });
+    }
+    for (auto& link : Links)
+    {
+      ParticleLinkOffsets[link.A + 1]++;
+      ParticleLinkOffsets[link.B + 1]++;
+    }
+    for (int i = 0; i < particleCount; i++)
+      ParticleLinkOffsets[i + 1] += ParticleLinkOffsets[i];
+    ParticleLinks.resize(Links.size() * 2);
+    std::vector<int> fill(ParticleLinkOffsets.begin(), ParticleLinkOffsets.end() - 1);
+    for (int i = 0; i < (int)Links.size(); i++)
+    {
+      ParticleLinks[fill[Links[i].A]++] = i;
+      ParticleLinks[fill[Links[i].B]++] = i;
+    }
+
+    Params = Parameters();
+    Params.In.Viscosity = 10;
+    Params.In.ParticleAttraction = -1;
+    Params.In.ParticlePower = -2;
+    Params.In.LinkAttraction = 10;
+    Params.In.LinkPower = -1;
+  }
+};
+
+template<int Dim>
+static void AddKernelCases(std::vector<Case>& cases)
+{
+  std::string suffix = "/" + std::to_string(Dim) + "D";
+  int particleCount = 2048;
+  auto pairs = std::make_shared<KernelData<Dim>>(particleCount, 0);
+  cases.push_back({ "PairForceRows" + suffix, "pairs/s", [pairs, particleCount]()
+  {
+    auto& d = *pairs;
+    PairForceRows(ParticlePositions<double, Dim>{ d.Inputs.data() }, d.Inputs.data(), d.Infos.data(), particleCount, 0, particleCount, d.Params, d.Outputs.data());
+    return double(particleCount) * (particleCount - 1);
+  } });
+  // The single-threaded path of Engine::Calculate, which visits each pair once
+  cases.push_back({ "SymmetricPairForces" + suffix, "pairs/s", [pairs, particleCount]()
+  {
+    auto& d = *pairs;
+    SymmetricPairForces(d.Inputs.data(), d.Infos.data(), particleCount, d.Params, d.Outputs.data());
+    return double(particleCount) * (particleCount - 1) / 2;
+  } });
+
+  particleCount = 65536;
+  auto links = std::make_shared<KernelData<Dim>>(particleCount, particleCount * 4);
+  cases.push_back({ "IncidentLinkForces" + suffix, "link ends/s", [links, particleCount]()
+  {
+    auto& d = *links;
+    for (int i = 0; i < particleCount; i++)
+    {
+      IncidentLinkForces(d.Inputs.data(), d.Infos.data(), d.Links.data(), d.ParticleLinks.data(),
+        i, d.ParticleLinkOffsets[i], d.ParticleLinkOffsets[i + 1], d.Params, d.Outputs[i].Velocity);
+    }
+    return double(d.ParticleLinks.size());
+  } });
+  cases.push_back({ "SymmetricLinkForces" + suffix, "links/s", [links]()
+  {
+    auto& d = *links;
+    SymmetricLinkForces(d.Inputs.data(), d.Infos.data(), d.Links.data(), (int)d.Links.size(), d.Params, d.Outputs.data());
+    return double(d.Links.size());
+  } });
+}
+
+static double Measure(const Case& c, int repeats, double seconds)
+{
+  // Untimed, so that the first repeat does not pay for cold caches and page faults
+  c.Batch();
+  std::vector<double> throughputs;
+  for (int r = 0; r < repeats; r++)
+  {
+    double operations = 0;
+    StopWatch stopwatch;
+    double elapsed;
+    do
+    {
+      operations += c.Batch();
+      elapsed = stopwatch.Seconds();
+    } while (elapsed < seconds);
+    throughputs.push_back(operations / elapsed);
+  }
+  auto median = throughputs.begin() + throughputs.size() / 2;
+  std::nth_element(throughputs.begin(), median, throughputs.end());
+  return *median;
+}
+
+static bool ReadBaseline(const char* path, std::map<std::string, double>& baseline)
+{
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return false;
+  char name[256];
+  double throughput;
+  while (fscanf(file, "%255s %lf", name, &throughput) == 2)
+    baseline[name] = throughput;
+  fclose(file);
+  return true;
+}
+
+static bool WriteBaseline(const char* path, const std::map<std::string, double>& baseline)
+{
+  FILE* file = fopen(path, "w");
+  if (!file)
+    return false;
+  for (auto& entry : baseline)
+    fprintf(file, "%s %.6g\n", entry.first.c_str(), entry.second);
+  return fclose(file) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* baselinePath = nullptr;
+  bool record = false;
+  double tolerance = 0.15;
+  const char* filter = "";
+  int repeats = 9;
+  double seconds = 0.25;
+  for (int i = 1; i < argc; i++)
+  {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--baseline") == 0 && hasValue)
+      baselinePath = argv[++i];
+    else if (strcmp(argv[i], "--record") == 0)
+      record = true;
+    else if (strcmp(argv[i], "--tolerance") == 0 && hasValue)
+      tolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "--filter") == 0 && hasValue)
+      filter = argv[++i];
+    else if (strcmp(argv[i], "--repeats") == 0 && hasValue)
+      repeats = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--seconds") == 0 && hasValue)
+      seconds = atof(argv[++i]);
+    else
+    {
+      fprintf(stderr, "Usage: %s [--baseline file] [--record] [--tolerance 0.15] [--filter text] [--repeats 9] [--seconds 0.25]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (record && !baselinePath)
+  {
+    fprintf(stderr, "--record needs --baseline\n");
+    return 2;
+  }
+
+  std::vector<Case> cases;
+  AddVectorCases<1>(cases);
+  AddVectorCases<2>(cases);
+  AddVectorCases<3>(cases);
+  AddVectorCases<4>(cases);
+  AddVectorCases<8>(cases);
+  AddVectorCases<16>(cases);
+  AddVectorCases<64>(cases);
+  AddSolverCases(cases);
+  AddKernelCases<2>(cases);
+  AddKernelCases<3>(cases);
+
+  // Comparing against a baseline that is not there would pass without checking
+  // anything; a recording starts from whatever the file has
+  std::map<std::string, double> baseline;
+  if (baselinePath && !ReadBaseline(baselinePath, baseline) && !record)
+  {
+    fprintf(stderr, "Cannot read %s; make one with --record\n", baselinePath);
+    return 2;
+  }
+  printf("%-28s %14s %-12s %14s %8s\n", "case", "throughput", "unit", "baseline", "ratio");
+  int regressions = 0;
+  int missing = 0;
+  for (auto& c : cases)
+  {
+    if (c.Name.find(filter) == std::string::npos)
+      continue;
+    double throughput = Measure(c, repeats, seconds);
+    auto recorded = baseline.find(c.Name);
+    if (record)
+    {
+      // The slower of two measurements, so that a lucky one does not set a bar
+      // that later runs on the same machine cannot reach
+      throughput = std::min(throughput, Measure(c, repeats, seconds));
+      baseline[c.Name] = throughput;
+      printf("%-28s %14.4g %-12s %14s %8s\n", c.Name.c_str(), throughput, c.Unit, "", "recorded");
+    }
+    else if (recorded == baseline.end())
+    {
+      missing += baselinePath != nullptr;
+      printf("%-28s %14.4g %-12s %14s %8s\n", c.Name.c_str(), throughput, c.Unit, "-", baselinePath ? "MISSING" : "-");
+    }
+    else
+    {
+      // A slow case is measured again before it counts: a busy machine can slow
+      // down all the repeats of one measurement
+      if (throughput < recorded->second * (1 - tolerance))
+        throughput = std::max(throughput, Measure(c, repeats, seconds));
+      double ratio = throughput / recorded->second;
+      bool regressed = ratio < 1 - tolerance;
+      regressions += regressed;
+      printf("%-28s %14.4g %-12s %14.4g %8.3f%s\n", c.Name.c_str(), throughput, c.Unit, recorded->second, ratio, regressed ? "  REGRESSED" : "");
+    }
+    fflush(stdout);
+  }
+
+  if (record)
+  {
+    if (!WriteBaseline(baselinePath, baseline))
+    {
+      fprintf(stderr, "Cannot write %s\n", baselinePath);
+      return 2;
+    }
+    return 0;
+  }
+  if (regressions > 0)
+    printf("%d case(s) more than %.0f%% below the baseline\n", regressions, tolerance * 100);
+  if (missing > 0)
+  {
+    printf("%d case(s) not in %s; record it again\n", missing, baselinePath);
+    return 2;
+  }
+  return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+// Compares the memory placements of NumaPlacement on the particle-particle kernel.
+//
+// A full evaluation of a million particles takes minutes, so every thread computes
+// a sample of rows from its own partition. Each row still reads all positions,
+// which is the traffic that placement is about; the full evaluation time is
+// extrapolated from the sample.
+//
+// Usage: NumaBenchmark [particles = 1000000] [rows per thread = 16] [threads = all] [repeats = 5]
+
+#include "Arena.h"
+#include "Kernels.h"
+#include "Numa.h"
+#include "StopWatch.h"
+#include "ThreadTeam.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using MyParticle = Particle<double, 2>;
+using MyVector = Vector<double, 2>;
+
+struct Result
+{
+  double PairSeconds;
+  double CopySeconds;
+};
+
+static Result Measure(NumaPlacement placement, const NumaTopology& topology, int particleCount, int rows, int threadCount, int repeats)
+{
+  ThreadTeam team;
+  team.Start(threadCount, placement == NumaPlacement::None ? nullptr : &topology);
+  std::vector<int> partition(team.Size() + 1);
+  for (int t = 0; t <= team.Size(); t++)
+    partition[t] = int((long long)particleCount * t / team.Size());
+
+  Arena memory;
+  MyParticle* inputs = memory.Allocate<MyParticle>(particleCount);
+  MyParticle* outputs = memory.Allocate<MyParticle>(particleCount);
+  ParticleInfo* infos = memory.Allocate<ParticleInfo>(particleCount);
+  std::vector<MyVector*> replicas;
+  if (placement == NumaPlacement::Replicated)
+  {
+    for (int node = 0; node < team.NodeCount(); node++)
+      replicas.push_back(memory.Allocate<MyVector>(particleCount));
+  }
+
+  auto replicaSlice = [&](int thread, int& begin, int& end)
+  {
+    int first, count;
+    team.NodeMembers(team.Node(thread), first, count);
+    begin = int((long long)particleCount * (thread - first) / count);
+    end = int((long long)particleCount * (thread - first + 1) / count);
+  };
+
+  if (placement == NumaPlacement::Interleaved)
+    InterleaveChunks(team, memory);
+
+  // Every member fills its own partition. With placement None the team is not
+  // pinned, so the pages follow wherever the OS happens to run the threads
+  team.Run([&](int thread)
+  {
+    std::mt19937 random(thread);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    for (int i = partition[thread]; i < partition[thread + 1]; i++)
+    {
+      inputs[i].Position.Data = { coordinate(random), coordinate(random) };
+      inputs[i].Velocity = {};
+      outputs[i] = {};
+      infos[i].Mass = 1;
+      infos[i].Fixed = false;
+    }
+    if (!replicas.empty())
+    {
+      int begin, end;
+      replicaSlice(thread, begin, end);
+      std::fill(replicas[team.Node(thread)] + begin, replicas[team.Node(thread)] + end, MyVector());
+    }
+  });
+
+  Parameters params = {};
+  params.In.ParticleAttraction = -1;
+  params.In.ParticlePower = -2;
+  params.In.Viscosity = 10;
+
+  Result best = { 1e300, 0 };
+  for (int r = 0; r < repeats; r++)
+  {
+    StopWatch stopwatch;
+    if (!replicas.empty())
+    {
+      team.Run([&](int thread)
+      {
+        int begin, end;
+        replicaSlice(thread, begin, end);
+        auto replica = replicas[team.Node(thread)];
+        for (int i = begin; i < end; i++)
+          replica[i] = inputs[i].Position;
+      });
+    }
+    double copySeconds = stopwatch.Seconds();
+    stopwatch.Reset();
+    team.Run([&](int thread)
+    {
+      int begin = partition[thread];
+      int end = std::min(begin + rows, partition[thread + 1]);
+      if (!replicas.empty())
+      {
+        const MyVector* replica = replicas[team.Node(thread)];
+        PairForceRows(replica, inputs, infos, particleCount, begin, end, params, outputs);
+      }
+      else
+      {
+        PairForceRows(ParticlePositions<double, 2>{ inputs }, inputs, infos, particleCount, begin, end, params, outputs);
+      }
+    });
+    double pairSeconds = stopwatch.Seconds();
+    if (pairSeconds < best.PairSeconds)
+      best = { pairSeconds, copySeconds };
+  }
+  return best;
+}
+
+int main(int argc, char* argv[])
+{
+  const NumaTopology& topology = NumaTopology::Global();
+  int particleCount = argc > 1 ? atoi(argv[1]) : 1000000;
+  int rows = argc > 2 ? atoi(argv[2]) : 16;
+  int threadCount = argc > 3 ? atoi(argv[3]) : topology.ProcessorCount();
+  int repeats = argc > 4 ? atoi(argv[4]) : 5;
+
+  printf("%d particles, %d rows per thread, %d threads, %d NUMA nodes\n", particleCount, rows, threadCount, topology.NodeCount());
+  printf("%-12s %14s %14s %16s\n", "placement", "ns per pair", "copy, ms", "full eval, s");
+
+  const struct
+  {
+    NumaPlacement Placement;
+    const char* Name;
+  } placements[] =
+  {
+    { NumaPlacement::None, "none" },
+    { NumaPlacement::Interleaved, "interleaved" },
+    { NumaPlacement::FirstTouch, "first-touch" },
+    { NumaPlacement::Replicated, "replicated" },
+  };
+  for (auto& p : placements)
+  {
+    auto result = Measure(p.Placement, topology, particleCount, rows, threadCount, repeats);
+    double pairsPerThread = double(rows) * particleCount;
+    double rowsPerThread = double(particleCount) / threadCount;
+    printf("%-12s %14.3f %14.3f %16.1f\n", p.Name,
+      result.PairSeconds / pairsPerThread * 1e9,
+      result.CopySeconds * 1e3,
+      result.CopySeconds + result.PairSeconds * rowsPerThread / rows);
+  }
+  return 0;
+}
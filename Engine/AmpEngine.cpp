@@ -7,6 +7,7 @@
 #include "StopWatch.h"
 #include <amp.h>
 #include <amp_math.h>
+#include <ppl.h>
 
 using namespace std;
 using namespace concurrency;
@@ -287,6 +288,24 @@ public:
 			Links[i].B = links[i].B;
 			Links[i].Strength = links[i].Strength;
 		}
+		// Links incident to each particle, in link order
+		ParticleLinkOffsets = new int[particleCount + 1]();
+		ParticleLinks = new int[linkCount * 2];
+		for(int i = 0; i < LinkCount; i++)
+		{
+			ParticleLinkOffsets[Links[i].A + 1]++;
+			ParticleLinkOffsets[Links[i].B + 1]++;
+		}
+		for(int i = 0; i < ParticleCount; i++)
+			ParticleLinkOffsets[i + 1] += ParticleLinkOffsets[i];
+		std::unique_ptr<int[]> fill(new int[particleCount]);
+		for(int i = 0; i < ParticleCount; i++)
+			fill[i] = ParticleLinkOffsets[i];
+		for(int i = 0; i < LinkCount; i++)
+		{
+			ParticleLinks[fill[Links[i].A]++] = i;
+			ParticleLinks[fill[Links[i].B]++] = i;
+		}
 		Solver.Initialize(particleCount * 4, &Items[0].Position.X, [this](const double* y, double* fy) { return Calculate((const Item*)y, (Item*)fy); });
 		ShouldStop = false;
 		InitializeCriticalSection(&CriticalSection);
@@ -298,6 +317,8 @@ public:
 		WaitForSingleObject(ThreadHandle, INFINITE);
 		DeleteCriticalSection(&CriticalSection);
 		delete [] Links; 
+		delete [] ParticleLinkOffsets;
+		delete [] ParticleLinks;
 		delete [] Items; 
 		delete [] Extras; 
 	}
@@ -352,6 +373,8 @@ private:
 	long LinkCount;
 
     Link* Links;
+	int* ParticleLinkOffsets;
+	int* ParticleLinks;
 	Parameters Params;
 	Parameters BarrierParams;
 	HANDLE ThreadHandle;
@@ -398,17 +421,29 @@ private:
 
 		out.synchronize();
 
-		auto endLink = Links + LinkCount;
-        for (auto l = Links; l != endLink; l++)
-        {
-            auto v = Items[l->B].Position - Items[l->A].Position;
-            double dist = v.Length();
-            v *= Params.In.LinkAttraction * l->Strength / pow(dist, Params.In.LinkPower - 1);
-            outputs[l->A].Velocity += v * Extras[l->B].Mass;
-            outputs[l->B].Velocity -= v * Extras[l->A].Mass;
-            outputs[l->A].Velocity.X -= Params.In.StretchAttraction;
-            outputs[l->B].Velocity.X += Params.In.StretchAttraction;
-        }
+		// Every particle sums its own links, so the particles can go in parallel
+		// without two threads writing the same output
+		concurrency::parallel_for(0, (int)ParticleCount, [&](int i)
+		{
+			auto& output = outputs[i];
+			for (int k = ParticleLinkOffsets[i]; k < ParticleLinkOffsets[i + 1]; k++)
+			{
+				auto l = Links + ParticleLinks[k];
+				auto v = Items[l->B].Position - Items[l->A].Position;
+				double dist = v.Length();
+				v *= Params.In.LinkAttraction * l->Strength / pow(dist, Params.In.LinkPower - 1);
+				if (l->A == i)
+				{
+					output.Velocity += v * Extras[l->B].Mass;
+					output.Velocity.X -= Params.In.StretchAttraction;
+				}
+				else
+				{
+					output.Velocity -= v * Extras[l->A].Mass;
+					output.Velocity.X += Params.In.StretchAttraction;
+				}
+			}
+		});
 		for (int i = ParticleCount - 1; i >= 0; i--)
         {
 			outputs[i].Position = inputs[i].Velocity;
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Working memory of one engine. Blocks are mapped straight from the OS, backed by
+// large pages when the system allows it, and handed out 64-byte aligned.
+// Nothing is written here, so with first-touch placement every page ends up on the
+// NUMA node of the thread that fills it first.
+class Arena
+{
+public:
+  static const size_t Alignment = 64;
+  static const size_t BlockSize = 2 << 20;
+
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator = (const Arena&) = delete;
+
+  ~Arena()
+  {
+    Release();
+  }
+
+  // Returns uninitialized storage; the caller must write every element before reading it.
+  template<typename T>
+  T* Allocate(size_t count)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Arena holds plain data only");
+    return reinterpret_cast<T*>(AllocateBytes(count * sizeof(T)));
+  }
+
+  void Release()
+  {
+    for (auto& block : Blocks)
+      Unmap(block);
+    Blocks.clear();
+  }
+
+  size_t Used() const
+  {
+    size_t result = 0;
+    for (auto& block : Blocks)
+      result += block.Used;
+    return result;
+  }
+
+  size_t Reserved() const
+  {
+    size_t result = 0;
+    for (auto& block : Blocks)
+      result += block.Size;
+    return result;
+  }
+
+  size_t LargePages() const
+  {
+    size_t result = 0;
+    for (auto& block : Blocks)
+    {
+      if (block.Large)
+        result += block.Size;
+    }
+    return result;
+  }
+
+  // Calls f(data, size) for every BlockSize piece of the mapped memory, in allocation order
+  template<typename F>
+  void ForEachChunk(F f) const
+  {
+    for (auto& block : Blocks)
+    {
+      for (size_t offset = 0; offset < block.Size; offset += BlockSize)
+        f(block.Data + offset, BlockSize);
+    }
+  }
+
+private:
+  struct Block
+  {
+    char* Data;
+    size_t Size;
+    size_t Used;
+    bool Large;
+  };
+  std::vector<Block> Blocks;
+
+  void* AllocateBytes(size_t size)
+  {
+    size = size == 0 ? Alignment : (size + Alignment - 1) & ~(Alignment - 1);
+    if (Blocks.empty() || Blocks.back().Size - Blocks.back().Used < size)
+      Blocks.push_back(Map((size + BlockSize - 1) / BlockSize * BlockSize));
+    auto& block = Blocks.back();
+    void* result = block.Data + block.Used;
+    block.Used += size;
+    return result;
+  }
+
+#ifdef _WIN32
+  static Block Map(size_t size)
+  {
+    // Large pages need SeLockMemoryPrivilege; fall back to normal pages without it
+    size_t largePage = GetLargePageMinimum();
+    if (largePage != 0 && size % largePage == 0)
+    {
+      void* data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+      if (data)
+        return Block{ (char*)data, size, 0, true };
+    }
+    void* data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!data)
+      throw std::bad_alloc();
+    return Block{ (char*)data, size, 0, false };
+  }
+
+  static void Unmap(const Block& block)
+  {
+    VirtualFree(block.Data, 0, MEM_RELEASE);
+  }
+#else
+  static Block Map(size_t size)
+  {
+    // Transparent huge pages need a 2 MB aligned range, so map one block more and trim
+    size_t mapped = size + BlockSize;
+    void* raw = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+      throw std::bad_alloc();
+    char* begin = (char*)raw;
+    char* data = (char*)(((size_t)begin + BlockSize - 1) & ~(BlockSize - 1));
+    if (data != begin)
+      munmap(begin, data - begin);
+    if (data + size != begin + mapped)
+      munmap(data + size, begin + mapped - (data + size));
+    bool large = false;
+#ifdef MADV_HUGEPAGE
+    large = madvise(data, size, MADV_HUGEPAGE) == 0;
+#endif
+    return Block{ data, size, 0, large };
+  }
+
+  static void Unmap(const Block& block)
+  {
+    munmap(block.Data, block.Size);
+  }
+#endif
+};
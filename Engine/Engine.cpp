@@ -1,7 +1,88 @@
 #include "Engine.h"
+#include "GraphFile.h"
+#include "LayoutCache.h"
 #include "Model.h"
+#include "StressEngine.h"
 
 
+// Dimensions up to MaxUnrolledDimension get an engine of their own, with every
+// vector operation unrolled. Higher ones run padded in the narrowest of the wide
+// engines that fits: same results, at the cost of the padding coordinates. There
+// is no engine beyond MaxDimension; Engine.cs checks the same limit.
+static const int MaxUnrolledDimension = 8;
+static const int MaxDimension = 64;
+
+// Values of Parameters::In::LayoutAlgorithm
+enum LayoutAlgorithm
+{
+  ForceSimulation = 0,
+  SparseStress = 1,
+  LayoutAlgorithmCount
+};
+
+typedef EngineBase* (*EngineFactory)(int dimension);
+
+template<template<typename, int> class EngineType, int Dim>
+static EngineBase* NewEngine(int dimension)
+{
+  return new EngineType<double, Dim>(dimension);
+}
+
+// Fills table[1..Dim] at compile time
+template<template<typename, int> class EngineType, int Dim>
+struct EngineTable
+{
+  static void Fill(EngineFactory* table)
+  {
+    EngineTable<EngineType, Dim - 1>::Fill(table);
+    table[Dim] = &NewEngine<EngineType, Dim>;
+  }
+};
+
+template<template<typename, int> class EngineType>
+struct EngineTable<EngineType, 0>
+{
+  static void Fill(EngineFactory*)
+  {}
+};
+
+template<template<typename, int> class EngineType>
+static EngineBase* NewPaddedEngine(int dimension)
+{
+  if (dimension <= 16)
+    return new EngineType<double, 16>(dimension);
+  if (dimension <= 32)
+    return new EngineType<double, 32>(dimension);
+  if (dimension <= MaxDimension)
+    return new EngineType<double, MaxDimension>(dimension);
+  throw std::runtime_error("Invalid dimension value");
+}
+
+static const struct EngineFactories
+{
+  EngineFactory Unrolled[LayoutAlgorithmCount][MaxUnrolledDimension + 1];
+  EngineFactory Padded[LayoutAlgorithmCount];
+
+  EngineFactories()
+    : Unrolled()
+  {
+    EngineTable<Engine, MaxUnrolledDimension>::Fill(Unrolled[ForceSimulation]);
+    EngineTable<StressEngine, MaxUnrolledDimension>::Fill(Unrolled[SparseStress]);
+    Padded[ForceSimulation] = &NewPaddedEngine<Engine>;
+    Padded[SparseStress] = &NewPaddedEngine<StressEngine>;
+  }
+} Factories;
+
+static EngineBase* CreateEngine(int dimension, int algorithm)
+{
+  if (algorithm < 0 || algorithm >= LayoutAlgorithmCount)
+    throw std::runtime_error("Invalid layout algorithm");
+  if (dimension >= 1 && dimension <= MaxUnrolledDimension)
+    return Factories.Unrolled[algorithm][dimension](dimension);
+  if (dimension > MaxUnrolledDimension)
+    return Factories.Padded[algorithm](dimension);
+  throw std::runtime_error("Invalid dimension value");
+}
 
 extern "C" __declspec(dllexport) void* EngineStart(
   Parameters* parameters, 
@@ -11,27 +92,51 @@ extern "C" __declspec(dllexport) void* EngineStart(
   __int64 particleCount,
   ParticleInfo* particleInfos,
   __int64 linkCount, 
-  LinkInfo* links)
+  LinkInfo* links,
+  __int64* particleIds)
 {
-  EngineBase* engine;
-  switch (dimension)
+  EngineBase* engine = CreateEngine(dimension, int(parameters->In.LayoutAlgorithm));
+  // A cached layout replaces the initial positions, but the caller's array is left alone.
+  // Deterministic runs bypass the cache, as their result must follow from the inputs alone.
+  engine->CacheKey = LayoutKey::Make(*parameters, dimension, particleCount, particleInfos, linkCount, links, particleIds);
+  std::vector<double> cachedData;
+  if (LayoutCache::Global().IsOpen() && parameters->In.Deterministic == 0)
   {
-    case 1:
-      engine = new Engine<double, 1>();
-      break;
-    case 2:
-      engine = new Engine<double, 2>();
-      break;
-    case 3:
-      engine = new Engine<double, 3>();
-      break;
-    default:
-      throw std::runtime_error("Invalid dimension value");
+    cachedData.assign(particleData, particleData + particleCount * dimension * 2);
+    if (LayoutCache::Global().Lookup(engine->CacheKey, cachedData.data()))
+      particleData = cachedData.data();
   }
   engine->Start(*parameters, particleCount, particleData, particleInfos, linkCount, links);
   return engine;
 }
 
+// Starts an engine on a graph file (see GraphFile::Load) without the caller building
+// the arrays. The counts receive the size of the graph, for sizing the arrays of
+// EngineSync and EngineParticleIds.
+extern "C" __declspec(dllexport) void* EngineStartFromFile(
+  Parameters* parameters,
+  int dimension,
+  const wchar_t* path,
+  __int64* particleCount,
+  __int64* linkCount)
+{
+  GraphData graph = GraphFile::Load(path, dimension);
+  *particleCount = graph.ParticleIds.size();
+  *linkCount = graph.Links.size();
+  return EngineStart(parameters, dimension,
+    graph.ParticleData.size(), graph.ParticleData.data(),
+    *particleCount, graph.ParticleInfos.data(),
+    *linkCount, graph.Links.data(),
+    graph.ParticleIds.data());
+}
+
+// Node ids of the particles: the ids given to EngineStart, or those in the file
+extern "C" __declspec(dllexport) void EngineParticleIds(void* engine, __int64* particleIds)
+{
+  auto& ids = ((EngineBase*)engine)->CacheKey.Ids;
+  std::copy(ids.begin(), ids.end(), particleIds);
+}
+
 extern "C" __declspec(dllexport) void EngineSync(
   void* engine, 
   Parameters* parameters, 
@@ -43,12 +148,88 @@ extern "C" __declspec(dllexport) void EngineSync(
   ((EngineBase*)engine)->Sync(*parameters, particleData, particleInfos);
 }
 
+// Level-of-detail sync for viewers. Exchanges the parameters like EngineSync, but
+// only the particles listed in fixedIndices are fixed, at fixedData, and only the
+// particles inside box (P1 then P2, `dimension` coordinates each, bounds included)
+// come back: their indices and data, up to capacity of them. Returns how many
+// particles are inside, which may be more than capacity.
+extern "C" __declspec(dllexport) __int64 EngineSyncRegion(
+  void* engine,
+  Parameters* parameters,
+  const double* box,
+  __int64 fixedCount,
+  const __int64* fixedIndices,
+  const double* fixedData,
+  __int64 capacity,
+  __int64* indices,
+  double* particleData)
+{
+  RegionRequest request = { box, long(fixedCount), fixedIndices, fixedData, long(capacity), false, indices, particleData };
+  return ((EngineBase*)engine)->SyncRegion(*parameters, request);
+}
+
+// Same exchange as EngineSyncRegion, but the particles inside box come back merged
+// into at most maxClusters clusters, the cells of a grid over the box: mean
+// position (`dimension` coordinates) and particle count of each. Returns the
+// number of clusters.
+extern "C" __declspec(dllexport) __int64 EngineSyncClusters(
+  void* engine,
+  Parameters* parameters,
+  const double* box,
+  __int64 fixedCount,
+  const __int64* fixedIndices,
+  const double* fixedData,
+  __int64 maxClusters,
+  double* clusterData)
+{
+  RegionRequest request = { box, long(fixedCount), fixedIndices, fixedData, long(maxClusters), true, nullptr, clusterData };
+  return ((EngineBase*)engine)->SyncRegion(*parameters, request);
+}
+
 extern "C" __declspec(dllexport) __int64 EngineStepCount(void* engine)
 {
   return ((EngineBase*)engine)->GetStepCount();
 }
 
+extern "C" __declspec(dllexport) void EngineMemoryFootprint(void* engine, MemoryFootprint* footprint)
+{
+  ((EngineBase*)engine)->GetMemoryFootprint(*footprint);
+}
+
+// Share of the engine pool relative to the other engines; 1 by default
+extern "C" __declspec(dllexport) void EngineSetPriority(void* engine, double priority)
+{
+  Scheduler::Global().SetPriority((EngineBase*)engine, priority);
+}
+
+// Steps per second; 0 = unlimited, the default
+extern "C" __declspec(dllexport) void EngineSetStepRateLimit(void* engine, double stepsPerSecond)
+{
+  Scheduler::Global().SetStepRateLimit((EngineBase*)engine, stepsPerSecond);
+}
+
 extern "C" __declspec(dllexport) void EngineStop(void* engine)
 {
-  delete (EngineBase*)engine;
+  auto e = (EngineBase*)engine;
+  e->Stop();
+  // Only finished layouts are worth starting from; one stopped midway is not stored
+  if (e->IsSettled() && e->GetParameters().In.Deterministic == 0 && LayoutCache::Global().IsOpen())
+  {
+    std::vector<double> particleData(e->GetParticleCount() * e->GetDimension() * 2);
+    e->ReadParticles(particleData.data());
+    // Filed under the parameters the layout settled with, which Sync may have changed
+    e->CacheKey.Rekey(e->GetParameters());
+    LayoutCache::Global().Store(e->CacheKey, particleData.data());
+  }
+  delete e;
+}
+
+extern "C" __declspec(dllexport) bool LayoutCacheOpen(const wchar_t* directory, __int64 maxBytes)
+{
+  return LayoutCache::Global().Open(directory, maxBytes);
+}
+
+extern "C" __declspec(dllexport) void LayoutCacheStatistics(LayoutCacheStats* stats)
+{
+  *stats = LayoutCache::Global().Statistics();
 }
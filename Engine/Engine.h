@@ -1,13 +1,24 @@
 #pragma once
 
+#include "Kernels.h"
+#include "LayoutCache.h"
 #include "Model.h"
+#include "RegionIndex.h"
+#include "Scheduler.h"
 #include "Solver.h"
 #include "StopWatch.h"
+#include "ThreadTeam.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 #include <mutex>
-#include <thread>
+#include <vector>
 
-class EngineBase
+// Engines have no threads of their own: they are stepped in slices on the
+// pool of Scheduler::Global() from Start until Stop.
+class EngineBase: public Schedulable
 {
 public:
   virtual ~EngineBase() = default;
@@ -21,25 +32,100 @@ public:
 
   virtual void Sync(Parameters& parameters, double* particleData, ParticleInfo* particleInfos) = 0;
 
+  // Level-of-detail sync: exchanges only the fixed particles and the particles,
+  // or clusters, inside a box. Returns how many there are in the box.
+  virtual long SyncRegion(Parameters& parameters, const RegionRequest& request) = 0;
+
+  // Copies the working particles out; only valid once the engine is stopped
+  virtual void ReadParticles(double* particleData) const = 0;
+
+  // Takes the engine off the scheduler; waits for a running slice to finish
   void Stop()
   {
-    ShouldStop = true;
-    WorkerThread.join();
+    Scheduler::Global().Remove(this);
   }
 
   __int64 GetStepCount() const
   {
     return Params.Out.StepCount;
   }
+
+  long GetParticleCount() const
+  {
+    return ParticleCount;
+  }
+
+  int GetDimension() const
+  {
+    return Dimension;
+  }
+
+  // Parameters the engine is simulating with; only valid once the engine is stopped
+  const Parameters& GetParameters() const
+  {
+    return Params;
+  }
+
+  // Whether the layout has come to rest; only valid once the engine is stopped
+  virtual bool IsSettled() const = 0;
+
+  // Identifies the layout in the layout cache
+  LayoutKey CacheKey;
+
+  void GetMemoryFootprint(MemoryFootprint& footprint) const
+  {
+    footprint.Used = Memory.Used();
+    footprint.Reserved = Memory.Reserved();
+    footprint.LargePages = Memory.LargePages();
+  }
 protected:
+  Arena Memory;
   Parameters Params;
+  // Coordinates per vector in the particle data passed in and out
+  int Dimension;
   long ParticleCount;
   long LinkCount;
 
   Parameters BarrierParams;
-  std::thread WorkerThread;
   std::mutex Mutex;
-  bool ShouldStop;
+
+  // Sync of either engine: syncParticles gets the caller's particles laid out as
+  // the engine's, padded when the engine runs in more dimensions
+  template<typename Number, int Dim, typename F>
+  void SyncPadded(double* particleData, F syncParticles)
+  {
+    if (Dimension == Dim)
+    {
+      syncParticles(reinterpret_cast<Particle<Number, Dim>*>(particleData));
+    }
+    else
+    {
+      std::vector<Particle<Number, Dim>> particles(ParticleCount);
+      PadParticles(particleData, Dimension, ParticleCount, particles.data());
+      syncParticles(particles.data());
+      UnpadParticles(particles.data(), Dimension, ParticleCount, particleData);
+    }
+  }
+
+  // SyncRegion of either engine, over its barrier and region index
+  template<typename Number, int Dim>
+  long ExchangeRegion(Parameters& parameters,
+    const RegionRequest& request,
+    Particle<Number, Dim>* barrier,
+    ParticleInfo* particleInfos,
+    RegionIndex<Number, Dim>& region)
+  {
+    std::unique_lock<std::mutex> lock(Mutex);
+    bool changed = memcmp(&BarrierParams.In, &parameters.In, sizeof(Params.In)) != 0;
+    changed |= region.SetFixed(barrier, particleInfos, Dimension, ParticleCount, request);
+    memcpy(&BarrierParams.In, &parameters.In, sizeof(Params.In));
+    memcpy(&parameters.Out, &BarrierParams.Out, sizeof(Params.Out));
+    long result = region.Query(barrier, particleInfos, Dimension, ParticleCount, request);
+    lock.unlock();
+    if (changed)
+      Scheduler::Global().Wake(this);
+    return result;
+  }
 };
 
 template<typename Number, int Dim>
@@ -48,6 +134,13 @@ class Engine: public EngineBase
 public:
   using MyParticle = Particle<Number, Dim>;
 
+  // With a dimension below Dim the engine runs padded: the extra coordinates
+  // start at zero and no force ever moves them, so they stay zero
+  explicit Engine(int dimension = Dim)
+  {
+    Dimension = dimension;
+  }
+
   ~Engine()
   {
     Stop();
@@ -64,44 +157,63 @@ public:
     BarrierParams = parameters;
     ParticleCount = particleCount;
     LinkCount = linkCount;
-    WorkingParticles.reset(new MyParticle[particleCount]);
-    ParticleInfos.reset(new ParticleInfo[particleCount]);
-    Links.reset(new LinkInfo[linkCount]);
-    BarrierParticles.reset(new MyParticle[particleCount]);
-    MyParticle* particles = reinterpret_cast<MyParticle*>(particleData);
-    for (int i = 0; i < ParticleCount; i++)
+
+    if (Dimension == Dim)
     {
-      WorkingParticles[i] = particles[i];
-      ParticleInfos[i] = particleInfos[i];
-      BarrierParticles[i] = particles[i];
+      Initialize(particleData, particleInfos, links);
     }
-    for (int i = 0; i < LinkCount; i++)
+    else
     {
-      Links[i] = links[i];
+      std::vector<MyParticle> particles(ParticleCount);
+      PadParticles(particleData, Dimension, ParticleCount, particles.data());
+      Initialize(reinterpret_cast<const double*>(particles.data()), particleInfos, links);
     }
-    Solver.Initialize(particleCount * Dim * 2, &WorkingParticles[0].Position.Data[0], [this](const Number* y, Number* fy)
-    {
-      return Calculate((const MyParticle*)y, (MyParticle*)fy);
-    });
-    ShouldStop = false;
+    Begin();
+    Scheduler::Global().Add(this);
+  }
 
-    WorkerThread = std::thread([this]()
+  virtual void Sync(Parameters& parameters, double* particleData, ParticleInfo* particleInfos) override
+  {
+    SyncPadded<Number, Dim>(particleData, [&](MyParticle* particles)
     {
-      Run();
+      SyncParticles(parameters, particles, particleInfos);
     });
   }
 
-  virtual void Sync(Parameters& parameters, double* particleData, ParticleInfo* particleInfos) override
+  virtual long SyncRegion(Parameters& parameters, const RegionRequest& request) override
   {
-    MyParticle* particles = reinterpret_cast<MyParticle*>(particleData);
+    return ExchangeRegion(parameters, request, BarrierParticles, ParticleInfos, Region);
+  }
 
-    std::lock_guard<std::mutex> lock(Mutex);
+  virtual void ReadParticles(double* particleData) const override
+  {
+    if (Dimension == Dim)
+      std::copy(WorkingParticles, WorkingParticles + ParticleCount, reinterpret_cast<MyParticle*>(particleData));
+    else
+      UnpadParticles(WorkingParticles, Dimension, ParticleCount, particleData);
+  }
+
+  virtual bool IsSettled() const override
+  {
+    return Params.In.IdleThreshold > 0 && Speed < Params.In.IdleThreshold;
+  }
+
+private:
+  void SyncParticles(Parameters& parameters, MyParticle* particles, const ParticleInfo* particleInfos)
+  {
+    std::unique_lock<std::mutex> lock(Mutex);
 
+    bool changed = memcmp(&BarrierParams.In, &parameters.In, sizeof(Params.In)) != 0;
+    Region.Forget();
     for (int i = 0; i < ParticleCount; i++)
     {
+      if (ParticleInfos[i].Fixed != particleInfos[i].Fixed)
+        changed = true;
       ParticleInfos[i].Fixed = particleInfos[i].Fixed;
       if (ParticleInfos[i].Fixed)
       {
+        if (memcmp(&BarrierParticles[i], &particles[i], sizeof(MyParticle)) != 0)
+          changed = true;
         BarrierParticles[i].Position = particles[i].Position;
         BarrierParticles[i].Velocity = particles[i].Velocity;
       }
@@ -114,92 +226,602 @@ public:
 
     memcpy(&BarrierParams.In, &parameters.In, sizeof(Params.In));
     memcpy(&parameters.Out, &BarrierParams.Out, sizeof(Params.Out));
+    lock.unlock();
+    if (changed)
+      Scheduler::Global().Wake(this);
   }
 
-private:
-  EulerSolver<Number> Solver;
+  BlockEulerSolver<Number> Solver;
   //	RungeKuttaSolver<Number> Solver;
 
-  std::unique_ptr<MyParticle[]> WorkingParticles;
-  std::unique_ptr<LinkInfo[]> Links;
-  std::unique_ptr<ParticleInfo[]> ParticleInfos;
+  MyParticle* WorkingParticles;
+  LinkInfo* Links;
+  ParticleInfo* ParticleInfos;
+
+  // Links incident to each particle: ParticleLinks[ParticleLinkOffsets[i] .. ParticleLinkOffsets[i + 1])
+  int* ParticleLinkOffsets;
+  int* ParticleLinks;
+
+  // The parallel link pass has every particle sum the forces of its own links, so
+  // no two threads write the same output. The incident links are cut into segments
+  // of at most HubSegmentSize, so that hubs are shared out too: the segments of a
+  // split particle are summed into LinkPartials and added up in order afterwards.
+  // The cuts do not depend on the team size, nor does the result.
+  static const int HubSegmentSize = 1024;
+  struct LinkSegment
+  {
+    int Particle;
+    int Begin;
+    int End;
+    int Partial;  // index into LinkPartials; -1 when the particle is not split
+  };
+  struct LinkPartial
+  {
+    Vector<Number, Dim> Force;
+    Number Potential;
+  };
+  std::vector<LinkSegment> LinkSegments;
+  std::vector<LinkPartial> LinkPartials;
+  // Member t processes LinkSegments[LinkPartition[t] .. LinkPartition[t + 1]), about
+  // the same number of links for every member
+  std::vector<int> LinkPartition;
+
+  MyParticle* BarrierParticles;
+  RegionIndex<Number, Dim> Region;
+
+  // Potential energy by particle, filled by the evaluations that update the diagnostics
+  Number* Potentials;
+
+  // Snapshot publishing runs as a pipeline. At a sync point a slice copies the
+  // state into Snapshot and goes on stepping, while RunPublish, on another pool
+  // thread, merges the snapshot into the barrier under Mutex and collects the fixed
+  // particles and parameters to inject. The next step boundary applies those.
+  enum PublishStage { PublishIdle, PublishRequested, PublishReady };
+  struct StepTimes
+  {
+    double Sum;
+    double Squares;
+    int Count;
+  };
+  MyParticle* Snapshot;
+  MyParticle* Injection;
+  // The fixed particles as Publish found them, under Mutex
+  int* InjectionIndices;
+  int InjectionCount;
+  // Fixed flags for the slice side, from the last applied injection list. Sync
+  // writes those of ParticleInfos under Mutex.
+  bool* Fixed;
+  decltype(Parameters::In) PendingIn;
+  decltype(Parameters::Out) SnapshotOut;
+  StepTimes SnapshotTimes;
+  StepTimes Times;
+  double SnapshotSeconds;
+  // Fastest non-fixed particle in the last applied snapshot, for the idle test
+  double SnapshotSpeed;
+  double Speed;
+  std::atomic<int> Stage;
+  // Whoever sets it first publishes a requested snapshot: the pool, or a slice
+  // that cannot go on without it
+  std::atomic<bool> PublishClaimed;
+  std::mutex PublishMutex;
+  std::condition_variable PublishDone;
+
+  // Stepping state carried from one slice to the next
+  StopWatch SyncStopwatch;
+  StopWatch StepStopwatch;
+  StopWatch IdleStopwatch;
+  __int64 NextSyncStep;
+  bool Sleeping;
+
+  // Force evaluation threads; member t owns the particles [Partition[t], Partition[t + 1])
+  ThreadTeam Team;
+  NumaPlacement Placement;
+  std::vector<int> Partition;
+  // Per-node copies of the positions being evaluated, for NumaPlacement::Replicated
+  std::vector<Vector<Number, Dim>*> Replicas;
+
+  void Initialize(const double* particleData, const ParticleInfo* particleInfos, const LinkInfo* links)
+  {
+    // By default the force work goes to idle threads of the engine pool, which a
+    // team per engine on top of the pool would oversubscribe. Memory placement
+    // needs members pinned to their nodes, so it still gets a team, no larger
+    // than the pool.
+    int threadCount = int(Params.In.ThreadCount);
+    Placement = NumaPlacement(int(Params.In.MemoryPlacement));
+    if (threadCount <= 0 && Placement == NumaPlacement::None)
+      Team.StartShared(Scheduler::Global().ThreadCount(), Scheduler::Global());
+    else if (threadCount <= 0)
+      Team.Start(std::min(NumaTopology::Global().ProcessorCount(), Scheduler::Global().ThreadCount()), &NumaTopology::Global(), false);
+    else
+      Team.Start(threadCount, Placement == NumaPlacement::None ? nullptr : &NumaTopology::Global(), false);
+    Partition.resize(Team.Size() + 1);
+    for (int t = 0; t <= Team.Size(); t++)
+      Partition[t] = int((long long)ParticleCount * t / Team.Size());
 
-  std::unique_ptr<MyParticle[]> BarrierParticles;
+    WorkingParticles = Memory.Allocate<MyParticle>(ParticleCount);
+    ParticleInfos = Memory.Allocate<ParticleInfo>(ParticleCount);
+    Links = Memory.Allocate<LinkInfo>(LinkCount);
+    BarrierParticles = Memory.Allocate<MyParticle>(ParticleCount);
+    Potentials = Memory.Allocate<Number>(ParticleCount);
+    Snapshot = Memory.Allocate<MyParticle>(ParticleCount);
+    Injection = Memory.Allocate<MyParticle>(ParticleCount);
+    InjectionIndices = Memory.Allocate<int>(ParticleCount);
+    Fixed = Memory.Allocate<bool>(ParticleCount);
+    ParticleLinkOffsets = Memory.Allocate<int>(ParticleCount + 1);
+    ParticleLinks = Memory.Allocate<int>(LinkCount * 2);
+    if (Placement == NumaPlacement::Replicated)
+    {
+      for (int node = 0; node < Team.NodeCount(); node++)
+        Replicas.push_back(Memory.Allocate<Vector<Number, Dim>>(ParticleCount));
+    }
+    Solver.Initialize(Memory, ParticleCount * Dim * 2, &WorkingParticles[0].Position.Data[0], [this](const Number* y, Number* fy)
+    {
+      return Calculate((const MyParticle*)y, (MyParticle*)fy);
+    }, Dim * 2, [this](const Number* y, Number* fy, const int* active, int activeCount)
+    {
+      return CalculatePartial((const MyParticle*)y, (MyParticle*)fy, active, activeCount);
+    });
+    Place();
 
+    const MyParticle* particles = reinterpret_cast<const MyParticle*>(particleData);
+    for (int i = 0; i < ParticleCount; i++)
+    {
+      WorkingParticles[i] = particles[i];
+      ParticleInfos[i] = particleInfos[i];
+      Fixed[i] = particleInfos[i].Fixed;
+      BarrierParticles[i] = particles[i];
+    }
+    for (int i = 0; i < LinkCount; i++)
+    {
+      Links[i] = links[i];
+    }
+    BuildParticleLinks();
+  }
+
+  // Touches the freshly allocated memory from the team so that the pages land
+  // on the nodes selected by Placement
+  void Place()
+  {
+    switch (Placement)
+    {
+      case NumaPlacement::Interleaved:
+        InterleaveChunks(Team, Memory);
+        break;
+      case NumaPlacement::FirstTouch:
+      case NumaPlacement::Replicated:
+        Team.Run([this](int thread)
+        {
+          int begin = Partition[thread];
+          int end = Partition[thread + 1];
+          std::fill(WorkingParticles + begin, WorkingParticles + end, MyParticle());
+          std::fill(BarrierParticles + begin, BarrierParticles + end, MyParticle());
+          std::fill(Snapshot + begin, Snapshot + end, MyParticle());
+          std::fill(Potentials + begin, Potentials + end, Number());
+          memset(ParticleInfos + begin, 0, (end - begin) * sizeof(ParticleInfo));
+          Solver.Touch(begin * Dim * 2, end * Dim * 2);
+          if (!Replicas.empty())
+          {
+            int replicaBegin, replicaEnd;
+            ReplicaSlice(thread, replicaBegin, replicaEnd);
+            auto replica = Replicas[Team.Node(thread)];
+            std::fill(replica + replicaBegin, replica + replicaEnd, Vector<Number, Dim>());
+          }
+        });
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Part of its node's replica that a member fills
+  void ReplicaSlice(int thread, int& begin, int& end)
+  {
+    int first, count;
+    Team.NodeMembers(Team.Node(thread), first, count);
+    begin = int((long long)ParticleCount * (thread - first) / count);
+    end = int((long long)ParticleCount * (thread - first + 1) / count);
+  }
+
+  void CalculatePairs(const MyParticle* inputs, MyParticle* outputs, Number* potentials)
+  {
+    if (!Replicas.empty())
+    {
+      Team.Run([&](int thread)
+      {
+        int begin, end;
+        ReplicaSlice(thread, begin, end);
+        auto replica = Replicas[Team.Node(thread)];
+        for (int i = begin; i < end; i++)
+          replica[i] = inputs[i].Position;
+      });
+      Team.Run([&](int thread)
+      {
+        const Vector<Number, Dim>* replica = Replicas[Team.Node(thread)];
+        PairForceRows(replica, inputs, ParticleInfos, ParticleCount, Partition[thread], Partition[thread + 1], Params, outputs, potentials);
+      });
+    }
+    else
+    {
+      Team.Run([&](int thread)
+      {
+        ParticlePositions<Number, Dim> positions{ inputs };
+        PairForceRows(positions, inputs, ParticleInfos, ParticleCount, Partition[thread], Partition[thread + 1], Params, outputs, potentials);
+      });
+    }
+  }
+
+  // The evaluation at the current state also updates the energy and residual
+  // diagnostics of Params.Out. The energies are by-products of the force passes;
+  // what is left is one pass over the particles, summed in index order so that
+  // deterministic mode reports the same figures for any thread count.
   void Calculate(const MyParticle* inputs, MyParticle* outputs)
   {
-    for (int i = ParticleCount - 1; i >= 0; i--)
+    bool diagnose = inputs == WorkingParticles;
+    Number linkPotential = 0;
+
+    // The symmetric serial loop sums in a different order than the row kernel,
+    // so deterministic mode always uses the rows to match any thread count
+    if (Team.Size() > 1 || Params.In.Deterministic != 0)
     {
-      outputs[i].Velocity = {};
+      CalculatePairs(inputs, outputs, diagnose ? Potentials : nullptr);
     }
-    for (int i = ParticleCount - 1; i >= 0; i--)
+    else
     {
-      for (int j = i - 1; j >= 0; j--)
+      SymmetricPairForces(inputs, ParticleInfos, ParticleCount, Params, outputs, diagnose ? Potentials : nullptr);
+    }
+
+    // Every link is evaluated from both ends in the parallel pass, which pays
+    // off only with more than one thread. For a particle that is not split the
+    // two passes sum in the same order.
+    if (Team.Size() > 1 || Params.In.Deterministic != 0)
+    {
+      CalculateLinks(inputs, outputs, diagnose ? Potentials : nullptr);
+    }
+    else
+    {
+      SymmetricLinkForces(inputs, ParticleInfos, Links, LinkCount, Params, outputs, diagnose ? &linkPotential : nullptr);
+    }
+
+    if (diagnose)
+      Diagnose(inputs, outputs, linkPotential);
+  }
+
+  void LinkForces(const MyParticle* inputs, int i, int begin, int end, Vector<Number, Dim>& force, Number* potential)
+  {
+    IncidentLinkForces(inputs, ParticleInfos, Links, ParticleLinks, i, begin, end, Params, force, potential);
+  }
+
+  void CalculateLinks(const MyParticle* inputs, MyParticle* outputs, Number* potentials)
+  {
+    Team.Run([&](int thread)
+    {
+      for (int s = LinkPartition[thread]; s < LinkPartition[thread + 1]; s++)
       {
-        auto v = (inputs[j].Position - inputs[i].Position);
-        auto dist = v.Length();
-        v *= Params.In.ParticleAttraction * pow(dist, Params.In.ParticlePower - 1);
-        outputs[i].Velocity += v * ParticleInfos[j].Mass;
-        outputs[j].Velocity -= v * ParticleInfos[i].Mass;
+        auto& segment = LinkSegments[s];
+        if (segment.Partial < 0)
+        {
+          LinkForces(inputs, segment.Particle, segment.Begin, segment.End, outputs[segment.Particle].Velocity,
+            potentials ? potentials + segment.Particle : nullptr);
+        }
+        else
+        {
+          auto& partial = LinkPartials[segment.Partial];
+          partial.Force = {};
+          partial.Potential = 0;
+          LinkForces(inputs, segment.Particle, segment.Begin, segment.End, partial.Force, potentials ? &partial.Potential : nullptr);
+        }
       }
-      outputs[i].Velocity -= inputs[i].Velocity * Params.In.Viscosity;
-      outputs[i].Velocity.Data[0] += Params.In.Gravity;
+    });
+    for (auto& segment : LinkSegments)
+    {
+      if (segment.Partial < 0)
+        continue;
+      outputs[segment.Particle].Velocity += LinkPartials[segment.Partial].Force;
+      if (potentials)
+        potentials[segment.Particle] += LinkPartials[segment.Partial].Potential;
+    }
+  }
+
+  void Diagnose(const MyParticle* inputs, const MyParticle* outputs, Number linkPotential)
+  {
+    double potential = linkPotential;
+    double kinetic = 0;
+    double maxResidual = 0;
+    double squares = 0;
+    int freeCount = 0;
+    for (int i = 0; i < ParticleCount; i++)
+    {
+      double mass = ParticleInfos[i].Mass;
+      potential += Potentials[i] - Params.In.Gravity * mass * inputs[i].Position.Data[0];
+      kinetic += mass * inputs[i].Velocity.LengthSquared() / 2;
+      if (Fixed[i])
+        continue;
+      // The solver's derivative is the acceleration, drag included
+      auto force = (outputs[i].Velocity + inputs[i].Velocity * Params.In.Viscosity) * mass;
+      double square = force.LengthSquared();
+      maxResidual = std::max(maxResidual, square);
+      squares += square;
+      freeCount++;
     }
+    Params.Out.PotentialEnergy = potential;
+    Params.Out.KineticEnergy = kinetic;
+    Params.Out.MaxResidual = sqrt(maxResidual);
+    Params.Out.RmsResidual = freeCount > 0 ? sqrt(squares / freeCount) : 0;
+  }
 
+  void BuildParticleLinks()
+  {
+    for (int i = 0; i <= ParticleCount; i++)
+      ParticleLinkOffsets[i] = 0;
     for (int i = 0; i < LinkCount; i++)
     {
-      auto& link = Links[i];
-      auto v = inputs[link.B].Position - inputs[link.A].Position;
-      auto dist = v.Length();
-      v *= Params.In.LinkAttraction * link.Strength / pow(dist, Params.In.LinkPower - 1);
-      outputs[link.A].Velocity += v * ParticleInfos[link.B].Mass;
-      outputs[link.B].Velocity -= v * ParticleInfos[link.A].Mass;
-      outputs[link.A].Velocity.Data[0] -= Params.In.StretchAttraction;
-      outputs[link.B].Velocity.Data[0] += Params.In.StretchAttraction;
+      ParticleLinkOffsets[Links[i].A + 1]++;
+      ParticleLinkOffsets[Links[i].B + 1]++;
+    }
+    for (int i = 0; i < ParticleCount; i++)
+      ParticleLinkOffsets[i + 1] += ParticleLinkOffsets[i];
+    std::unique_ptr<int[]> fill(new int[ParticleCount]);
+    for (int i = 0; i < ParticleCount; i++)
+      fill[i] = ParticleLinkOffsets[i];
+    for (int i = 0; i < LinkCount; i++)
+    {
+      ParticleLinks[fill[Links[i].A]++] = i;
+      ParticleLinks[fill[Links[i].B]++] = i;
+    }
+
+    for (int i = 0; i < ParticleCount; i++)
+    {
+      int begin = ParticleLinkOffsets[i];
+      int end = ParticleLinkOffsets[i + 1];
+      bool split = end - begin > HubSegmentSize;
+      for (int k = begin; k < end; k += HubSegmentSize)
+      {
+        LinkSegments.push_back({ i, k, std::min(end, k + HubSegmentSize), split ? (int)LinkPartials.size() : -1 });
+        if (split)
+          LinkPartials.emplace_back();
+      }
     }
-    for (int i = ParticleCount - 1; i >= 0; i--)
+    // Cut at the segment where the running link count reaches the member's share
+    int total = LinkCount * 2;
+    LinkPartition.assign(Team.Size() + 1, (int)LinkSegments.size());
+    LinkPartition[0] = 0;
+    int segment = 0;
+    for (int t = 1; t < Team.Size(); t++)
     {
-      outputs[i].Position = inputs[i].Velocity;
+      long long share = (long long)total * t / Team.Size();
+      while (segment < (int)LinkSegments.size() && LinkSegments[segment].Begin < share)
+        segment++;
+      LinkPartition[t] = segment;
     }
   }
 
-  void Run()
+  // Same forces as Calculate, but only for the particles listed in active.
+  // Used by the block solver to substep stiff particles without a full evaluation.
+  void CalculatePartial(const MyParticle* inputs, MyParticle* outputs, const int* active, int activeCount)
+  {
+    for (int a = 0; a < activeCount; a++)
+    {
+      int i = active[a];
+      PairForceRows(ParticlePositions<Number, Dim>{ inputs }, inputs, ParticleInfos, ParticleCount, i, i + 1, Params, outputs);
+      LinkForces(inputs, i, ParticleLinkOffsets[i], ParticleLinkOffsets[i + 1], outputs[i].Velocity, nullptr);
+    }
+  }
+
+  // In deterministic mode the barrier is exchanged on a fixed step cadence instead
+  // of wall-clock time, so inputs always reach the simulation at the same step
+  static const int DeterministicSyncSteps = 16;
+
+  // Slice side: copies the state for the publisher and schedules it
+  void RequestPublish()
+  {
+    StopWatch stopwatch;
+    Team.Run([this](int thread)
+    {
+      std::copy(WorkingParticles + Partition[thread], WorkingParticles + Partition[thread + 1], Snapshot + Partition[thread]);
+    });
+    memcpy(&SnapshotOut, &Params.Out, sizeof(Params.Out));
+    SnapshotTimes = Times;
+    Times = {};
+    SnapshotSeconds = stopwatch.Seconds();
+    Stage = PublishRequested;
+    PublishClaimed = false;
+    Scheduler::Global().RequestPublish(this);
+  }
+
+  // Publishes the requested snapshot here unless the pool has already taken it,
+  // so that a slice never waits for a pool thread that may be busy with slices
+  void WaitPublished()
+  {
+    if (Stage == PublishRequested)
+      RunPublish();
+    std::unique_lock<std::mutex> lock(PublishMutex);
+    PublishDone.wait(lock, [this]() { return Stage != PublishRequested; });
+  }
+
+  // Slice side: injects what the publisher collected, if it is done
+  void ApplyPublished()
   {
-    StopWatch stopwatchSync;
+    if (Stage != PublishReady)
+      return;
     StopWatch stopwatch;
-    while (!ShouldStop)
+    std::fill(Fixed, Fixed + ParticleCount, false);
+    for (int k = 0; k < InjectionCount; k++)
     {
-      if (stopwatchSync.Seconds() > 0.030)
+      int i = InjectionIndices[k];
+      WorkingParticles[i].Position = Injection[k].Position;
+      WorkingParticles[i].Velocity = Injection[k].Velocity;
+      Fixed[i] = true;
+    }
+    memcpy(&Params.In, &PendingIn, sizeof(Params.In));
+    Speed = SnapshotSpeed;
+    Params.Out.SyncLatency = SnapshotSeconds + stopwatch.Seconds();
+    Stage = PublishIdle;
+  }
+
+  // Publisher side: the part of the exchange that used to stall the worker
+  void Publish()
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+
+    InjectionCount = 0;
+    Number speed = 0;
+    for (int i = 0; i < ParticleCount; i++)
+    {
+      if (ParticleInfos[i].Fixed)
       {
-        {
-          std::lock_guard<std::mutex> lock(Mutex);
+        Injection[InjectionCount].Position = BarrierParticles[i].Position;
+        Injection[InjectionCount].Velocity = BarrierParticles[i].Velocity;
+        InjectionIndices[InjectionCount++] = i;
+      }
+      else
+      {
+        BarrierParticles[i].Position = Snapshot[i].Position;
+        BarrierParticles[i].Velocity = Snapshot[i].Velocity;
+        speed = std::max(speed, Snapshot[i].Velocity.LengthSquared());
+      }
+    }
+    SnapshotSpeed = sqrt(double(speed));
+    if (Region.InUse())
+      Region.Build(BarrierParticles, ParticleInfos, Dimension, ParticleCount);
+    memcpy(&PendingIn, &BarrierParams.In, sizeof(Params.In));
 
-          for (int i = 0; i < ParticleCount; i++)
-          {
-            if (ParticleInfos[i].Fixed)
-            {
-              WorkingParticles[i].Position = BarrierParticles[i].Position;
-              WorkingParticles[i].Velocity = BarrierParticles[i].Velocity;
-            }
-            else
-            {
-              BarrierParticles[i].Position = WorkingParticles[i].Position;
-              BarrierParticles[i].Velocity = WorkingParticles[i].Velocity;
-            }
-          }
-          memcpy(&Params.In, &BarrierParams.In, sizeof(Params.In));
-          memcpy(&BarrierParams.Out, &Params.Out, sizeof(Params.Out));
-        }
-        stopwatchSync.Reset();
+    // Standard deviation of the step period since the previous snapshot
+    if (SnapshotTimes.Count > 0)
+    {
+      double mean = SnapshotTimes.Sum / SnapshotTimes.Count;
+      SnapshotOut.StepJitter = sqrt(std::max(0.0, SnapshotTimes.Squares / SnapshotTimes.Count - mean * mean));
+    }
+    memcpy(&BarrierParams.Out, &SnapshotOut, sizeof(Params.Out));
+  }
+
+  virtual void RunPublish() override
+  {
+    if (PublishClaimed.exchange(true))
+      return;
+    Publish();
+    {
+      std::lock_guard<std::mutex> lock(PublishMutex);
+      Stage = PublishReady;
+    }
+    PublishDone.notify_all();
+  }
+
+  bool StepLimitReached() const
+  {
+    return Params.In.StepLimit > 0 && Params.Out.StepCount >= Params.In.StepLimit;
+  }
+
+  // Nothing to simulate: stopped at the step limit, paused with a zero time step,
+  // or settled below IdleThreshold
+  bool IsIdle() const
+  {
+    if (StepLimitReached())
+      return true;
+    if ((Params.In.Deterministic != 0 ? Params.In.FixedTimeStep : Params.In.TimeScale) == 0)
+      return true;
+    return IsSettled();
+  }
+
+  // Publishes the current state before the engine parks. Sync wakes it up on a
+  // change, or the scheduler after IdleWakeInterval.
+  double Suspend()
+  {
+    WaitPublished();
+    ApplyPublished();
+    RequestPublish();
+    WaitPublished();
+    ApplyPublished();
+    Sleeping = true;
+    IdleStopwatch.Reset();
+    return Params.In.IdleWakeInterval > 0 ? Params.In.IdleWakeInterval : HUGE_VAL;
+  }
+
+  // Syncs to pick up whatever woke the engine, and keeps it stepping at least
+  // until the next snapshot is measured
+  void Resume()
+  {
+    Params.Out.IdleTime += IdleStopwatch.Seconds();
+    Sleeping = false;
+    RequestPublish();
+    WaitPublished();
+    ApplyPublished();
+    Speed = HUGE_VAL;
+    StepStopwatch.Reset();
+    SyncStopwatch.Reset();
+    NextSyncStep = Params.Out.StepCount + DeterministicSyncSteps;
+  }
+
+  void Begin()
+  {
+    Stage = PublishIdle;
+    PublishClaimed = true;
+    Times = {};
+    Speed = HUGE_VAL;
+    Sleeping = false;
+    NextSyncStep = 0;
+    SyncStopwatch.Reset();
+    StepStopwatch.Reset();
+  }
+
+  virtual SliceResult RunSlice(double seconds, __int64 maxSteps) override
+  {
+    SliceResult result = { 0, -1 };
+    if (Sleeping)
+      Resume();
+    StopWatch stopwatchSlice;
+    for (;;)
+    {
+      bool deterministic = Params.In.Deterministic != 0;
+      bool syncDue = SyncStopwatch.Seconds() > 0.030;
+      if (deterministic && !StepLimitReached())
+        syncDue = Params.Out.StepCount >= NextSyncStep;
+      if (deterministic && syncDue)
+      {
+        // The inputs have to reach the simulation at this very step, so the
+        // pipeline is drained instead of overlapped
+        WaitPublished();
+        ApplyPublished();
+        RequestPublish();
+        WaitPublished();
+        ApplyPublished();
+      }
+      else
+      {
+        ApplyPublished();
+        if (syncDue && Stage == PublishIdle)
+          RequestPublish();
+        else
+          syncDue = false;
+      }
+      if (syncDue)
+      {
+        SyncStopwatch.Reset();
+        NextSyncStep = Params.Out.StepCount + DeterministicSyncSteps;
+      }
+
+      if (IsIdle())
+      {
+        result.SleepSeconds = Suspend();
+        return result;
       }
 
-      double dt = stopwatch.Seconds();
+      double elapsed = StepStopwatch.Seconds();
+      double dt = deterministic ? Params.In.FixedTimeStep : elapsed * Params.In.TimeScale;
       if (dt == 0)
         continue;
-      stopwatch.Reset();
-      Params.Out.RealTimeScale = Solver.Step(dt * Params.In.TimeScale, Params.In.Accuracy) / dt;
+      StepStopwatch.Reset();
+      Solver.SetMaxLevel(int(Params.In.TimeStepLevels));
+      double step = Solver.Step(dt, Params.In.Accuracy);
+      if (elapsed > 0)
+        Params.Out.RealTimeScale = step / elapsed;
       Params.Out.StepCount++;
-      Params.Out.StepElapsedTime = stopwatch.Seconds();
+      Params.Out.StepElapsedTime = StepStopwatch.Seconds();
+      Times.Sum += elapsed;
+      Times.Squares += elapsed * elapsed;
+      Times.Count++;
+
+      if (++result.Steps >= maxSteps || stopwatchSlice.Seconds() >= seconds)
+        return result;
     }
   }
 };
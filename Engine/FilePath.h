@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cwchar>
+#include <string>
+
+// Multibyte form of a wide path in the current locale, for the narrow file APIs
+// outside Windows. Characters the locale cannot encode are dropped.
+inline std::string NarrowPath(const wchar_t* path)
+{
+  std::mbstate_t state = std::mbstate_t();
+  std::string result;
+  char buffer[8];
+  for (; *path; path++)
+  {
+    size_t length = wcrtomb(buffer, *path, &state);
+    if (length != size_t(-1))
+      result.append(buffer, length);
+  }
+  return result;
+}
@@ -0,0 +1,463 @@
+#pragma once
+
+#include "FilePath.h"
+#include "Model.h"
+#include "ThreadTeam.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+  explicit MappedFile(const wchar_t* path)
+  {
+#ifdef _WIN32
+    File = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER size;
+    if (File == INVALID_HANDLE_VALUE || !GetFileSizeEx(File, &size))
+      Fail("Cannot open the graph file");
+    Length = size_t(size.QuadPart);
+    if (Length == 0)
+      return;
+    Mapping = CreateFileMappingW(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (Mapping)
+      View = (const char*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    File = open(NarrowPath(path).c_str(), O_RDONLY);
+    struct stat info;
+    if (File < 0 || fstat(File, &info) != 0)
+      Fail("Cannot open the graph file");
+    Length = size_t(info.st_size);
+    if (Length == 0)
+      return;
+    void* view = mmap(nullptr, Length, PROT_READ, MAP_PRIVATE, File, 0);
+    if (view != MAP_FAILED)
+      View = (const char*)view;
+#endif
+    if (!View)
+      Fail("Cannot map the graph file");
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator = (const MappedFile&) = delete;
+
+  ~MappedFile()
+  {
+    Close();
+  }
+
+  const char* Data() const
+  {
+    return View;
+  }
+
+  size_t Size() const
+  {
+    return Length;
+  }
+
+private:
+#ifdef _WIN32
+  HANDLE File = INVALID_HANDLE_VALUE;
+  HANDLE Mapping = nullptr;
+#else
+  int File = -1;
+#endif
+  const char* View = nullptr;
+  size_t Length = 0;
+
+  void Close()
+  {
+#ifdef _WIN32
+    if (View)
+      UnmapViewOfFile(View);
+    if (Mapping)
+      CloseHandle(Mapping);
+    if (File != INVALID_HANDLE_VALUE)
+      CloseHandle(File);
+#else
+    if (View)
+      munmap((void*)View, Length);
+    if (File >= 0)
+      close(File);
+#endif
+  }
+
+  // The destructor does not run when the constructor throws
+  void Fail(const char* message)
+  {
+    Close();
+    throw std::runtime_error(message);
+  }
+};
+
+// Header of a binary CSR graph file. It is followed by Offsets[NodeCount + 1] as
+// int64, Targets[EntryCount] as int32 and, with CsrWeights, Weights[EntryCount] as
+// float. Entry k of row i is the link (i, Targets[k]), so every link is stored once.
+struct CsrHeader
+{
+  char Magic[4];        // "HCSR"
+  uint32_t Flags;
+  int64_t NodeCount;
+  int64_t EntryCount;
+};
+
+static const uint32_t CsrWeights = 1;
+
+// Graph in the form EngineStart takes. Particles have unit masses and are spread
+// at random, deterministically, over a cube of unit density around the origin.
+struct GraphData
+{
+  std::vector<double> ParticleData;
+  std::vector<ParticleInfo> ParticleInfos;
+  std::vector<LinkInfo> Links;
+  std::vector<__int64> ParticleIds;  // node id in the file
+};
+
+// Loads graph files straight into native memory. The file is mapped rather than
+// read, and the work is spread over a team of one thread per processor: the text
+// is parsed in chunks split at line boundaries, the CSR rows in ranges of equal
+// entry counts.
+class GraphFile
+{
+public:
+  // A binary CSR file, recognized by its magic, or else a text edge list with one
+  // link per line: "a b [strength]", separated by blanks or commas, where a and b
+  // are integer node ids. Lines starting with # or % are comments. Particles of an
+  // edge list are numbered in order of first appearance; self-links are dropped.
+  // Throws std::runtime_error on a file that cannot be read or is malformed.
+  static GraphData Load(const wchar_t* path, int dimension)
+  {
+    MappedFile file(path);
+    ThreadTeam team;
+    team.Start((int)std::max(std::thread::hardware_concurrency(), 1u), nullptr, false);
+    GraphData graph;
+    if (file.Size() >= sizeof(CsrHeader) && memcmp(file.Data(), "HCSR", 4) == 0)
+      LoadCsr(file, team, graph);
+    else
+      LoadEdgeList(file, team, graph);
+    Spread(team, dimension, graph);
+    return graph;
+  }
+
+private:
+  struct RawLink
+  {
+    int64_t A;
+    int64_t B;
+    double Strength;
+  };
+
+  static void LoadCsr(const MappedFile& file, ThreadTeam& team, GraphData& graph)
+  {
+    CsrHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    int64_t n = header.NodeCount;
+    int64_t m = header.EntryCount;
+    size_t weightSize = (header.Flags & CsrWeights) ? sizeof(float) : 0;
+    if (n < 0 || n > INT32_MAX || m < 0 || m > INT32_MAX ||
+      file.Size() < sizeof(header) + (n + 1) * sizeof(int64_t) + m * (sizeof(int32_t) + weightSize))
+      throw std::runtime_error("Truncated CSR graph file");
+    const int64_t* offsets = (const int64_t*)(file.Data() + sizeof(header));
+    const int32_t* targets = (const int32_t*)(offsets + n + 1);
+    const float* weights = weightSize ? (const float*)(targets + m) : nullptr;
+    if (offsets[0] != 0 || offsets[n] != m)
+      throw std::runtime_error("Invalid CSR offsets");
+
+    // Rows [rows[t], rows[t + 1]) hold about m / size entries. Offsets are only
+    // checked below, hence the clamping.
+    int size = team.Size();
+    std::vector<int> rows(size + 1);
+    for (int t = 1; t < size; t++)
+      rows[t] = std::max(rows[t - 1], int(std::lower_bound(offsets, offsets + n, m * t / size) - offsets));
+    rows[size] = int(n);
+
+    // Counting the links of every range first lets them be written in place
+    std::vector<int64_t> counts(size + 1);
+    std::vector<char> valid(size, 1);
+    team.Run([&](int thread)
+    {
+      int64_t count = 0;
+      for (int i = rows[thread]; i < rows[thread + 1]; i++)
+      {
+        if (offsets[i + 1] < offsets[i] || offsets[i + 1] > m)
+        {
+          valid[thread] = 0;
+          return;
+        }
+        for (int64_t k = offsets[i]; k < offsets[i + 1]; k++)
+        {
+          if (targets[k] < 0 || targets[k] >= n)
+          {
+            valid[thread] = 0;
+            return;
+          }
+          count += targets[k] != i;
+        }
+      }
+      counts[thread + 1] = count;
+    });
+    if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+      throw std::runtime_error("Invalid CSR rows");
+    for (int t = 0; t < size; t++)
+      counts[t + 1] += counts[t];
+
+    graph.Links.resize(size_t(counts[size]));
+    graph.ParticleIds.resize(size_t(n));
+    team.Run([&](int thread)
+    {
+      LinkInfo* link = graph.Links.data() + counts[thread];
+      for (int i = rows[thread]; i < rows[thread + 1]; i++)
+      {
+        graph.ParticleIds[i] = i;
+        for (int64_t k = offsets[i]; k < offsets[i + 1]; k++)
+        {
+          if (targets[k] != i)
+            *link++ = { i, targets[k], weights ? weights[k] : 1.0 };
+        }
+      }
+    });
+  }
+
+  static void LoadEdgeList(const MappedFile& file, ThreadTeam& team, GraphData& graph)
+  {
+    const char* data = file.Data();
+    size_t length = file.Size();
+    int size = team.Size();
+    std::vector<size_t> chunks(size + 1);
+    for (int t = 0; t <= size; t++)
+    {
+      size_t pos = length / size * t;
+      if (t == size)
+        pos = length;
+      else if (pos > 0)
+      {
+        while (pos < length && data[pos - 1] != '\n')
+          pos++;
+      }
+      chunks[t] = pos;
+    }
+
+    std::vector<std::vector<RawLink>> parsed(size);
+    std::vector<size_t> errors(size, SIZE_MAX);
+    std::vector<int64_t> maxIds(size, -1);
+    std::vector<char> negative(size, 0);
+    team.Run([&](int thread)
+    {
+      auto& links = parsed[thread];
+      links.reserve((chunks[thread + 1] - chunks[thread]) / 8);
+      const char* p = data + chunks[thread];
+      const char* end = data + chunks[thread + 1];
+      while (p < end)
+      {
+        const char* line = p;
+        SkipBlanks(p, end);
+        if (p == end || *p == '\n' || *p == '#' || *p == '%')
+        {
+          SkipLine(p, end);
+          continue;
+        }
+        RawLink link = { 0, 0, 1 };
+        if (!ParseInteger(p, end, link.A) || !SkipSeparator(p, end) || !ParseInteger(p, end, link.B))
+        {
+          errors[thread] = line - data;
+          return;
+        }
+        if (SkipSeparator(p, end) && p < end && *p != '\n' && !ParseReal(p, end, link.Strength))
+        {
+          errors[thread] = line - data;
+          return;
+        }
+        SkipBlanks(p, end);
+        if (p < end && *p != '\n')
+        {
+          errors[thread] = line - data;
+          return;
+        }
+        SkipLine(p, end);
+        if (link.A == link.B)
+          continue;
+        links.push_back(link);
+        maxIds[thread] = std::max(maxIds[thread], std::max(link.A, link.B));
+        negative[thread] |= link.A < 0 || link.B < 0;
+      }
+    });
+    for (int t = 0; t < size; t++)
+    {
+      if (errors[t] != SIZE_MAX)
+        throw std::runtime_error("Malformed edge list at byte " + std::to_string(errors[t]));
+    }
+
+    size_t linkCount = 0;
+    for (auto& links : parsed)
+      linkCount += links.size();
+    int64_t maxId = *std::max_element(maxIds.begin(), maxIds.end());
+    bool dense = std::find(negative.begin(), negative.end(), 1) == negative.end() &&
+      maxId < int64_t(linkCount) * 8 + 1024;
+
+    // Ids are numbered in file order, so this part is serial. Ids no larger than
+    // a few times the link count index a table; others go through a hash map.
+    graph.Links.resize(linkCount);
+    std::vector<int> table(dense ? size_t(maxId + 1) : 0, -1);
+    std::unordered_map<int64_t, int> map;
+    if (!dense)
+      map.reserve(linkCount);
+    auto index = [&](int64_t id)
+    {
+      int& slot = dense ? table[size_t(id)] : map.emplace(id, -1).first->second;
+      if (slot < 0)
+      {
+        if (graph.ParticleIds.size() >= INT32_MAX)
+          throw std::runtime_error("Too many particles in the edge list");
+        slot = int(graph.ParticleIds.size());
+        graph.ParticleIds.push_back(id);
+      }
+      return slot;
+    };
+    LinkInfo* out = graph.Links.data();
+    for (auto& links : parsed)
+    {
+      for (auto& link : links)
+        *out++ = { index(link.A), index(link.B), link.Strength };
+      std::vector<RawLink>().swap(links);
+    }
+  }
+
+  // Unit masses and positions from a hash of the particle index, so that the result
+  // does not depend on the team size
+  static void Spread(ThreadTeam& team, int dimension, GraphData& graph)
+  {
+    size_t count = graph.ParticleIds.size();
+    graph.ParticleInfos.resize(count);
+    graph.ParticleData.resize(count * dimension * 2);
+    double side = pow(double(count), 1.0 / dimension);
+    team.Run([&](int thread)
+    {
+      size_t begin = count * thread / team.Size();
+      size_t end = count * (thread + 1) / team.Size();
+      for (size_t i = begin; i < end; i++)
+      {
+        graph.ParticleInfos[i].Mass = 1;
+        graph.ParticleInfos[i].Fixed = false;
+        double* position = &graph.ParticleData[i * dimension * 2];
+        for (int d = 0; d < dimension; d++)
+          position[d] = (double(Hash(i * dimension + d) >> 11) / 9007199254740992.0 - 0.5) * side;
+      }
+    });
+  }
+
+  // SplitMix64 finalizer
+  static uint64_t Hash(uint64_t x)
+  {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+  }
+
+  static void SkipBlanks(const char*& p, const char* end)
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+  }
+
+  static void SkipLine(const char*& p, const char* end)
+  {
+    while (p < end && *p++ != '\n')
+      ;
+  }
+
+  // Blanks and at most one comma; false at the end of the line
+  static bool SkipSeparator(const char*& p, const char* end)
+  {
+    SkipBlanks(p, end);
+    if (p < end && *p == ',')
+    {
+      p++;
+      SkipBlanks(p, end);
+    }
+    return p < end && *p != '\n';
+  }
+
+  static bool ParseInteger(const char*& p, const char* end, int64_t& value)
+  {
+    bool minus = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+      p++;
+    const char* digits = p;
+    uint64_t result = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+      if (result > (uint64_t(INT64_MAX) - (*p - '0')) / 10)
+        return false;
+      result = result * 10 + (*p - '0');
+    }
+    value = minus ? -int64_t(result) : int64_t(result);
+    return p != digits;
+  }
+
+  // Decimal with an optional fraction and exponent. The token is checked here and
+  // converted by strtod, which rounds correctly; the mapped file is not
+  // terminated, so the token is copied out first.
+  static bool ParseReal(const char*& p, const char* end, double& value)
+  {
+    const char* start = p;
+    if (p < end && (*p == '-' || *p == '+'))
+      p++;
+    int digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+      digits++;
+    if (p < end && *p == '.')
+    {
+      for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        digits++;
+    }
+    if (digits == 0)
+      return false;
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+      p++;
+      int64_t power;
+      if (!ParseInteger(p, end, power))
+        return false;
+    }
+    char buffer[64];
+    std::string longer;
+    const char* text = buffer;
+    size_t length = p - start;
+    if (length < sizeof(buffer))
+    {
+      memcpy(buffer, start, length);
+      buffer[length] = 0;
+    }
+    else
+    {
+      longer.assign(start, p);
+      text = longer.c_str();
+    }
+    value = strtod(text, nullptr);
+    return true;
+  }
+};
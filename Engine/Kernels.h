@@ -0,0 +1,216 @@
+#pragma once
+
+#include "Model.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Particle data crosses the API with `dimension` coordinates per vector. Engines
+// wider than that run padded: the extra coordinates are zero on the way in and
+// dropped on the way out.
+template<typename Number, int Dim>
+void PadParticles(const double* particleData, int dimension, long count, Particle<Number, Dim>* particles)
+{
+  for (long i = 0; i < count; i++, particleData += dimension * 2)
+  {
+    particles[i] = Particle<Number, Dim>();
+    std::copy(particleData, particleData + dimension, particles[i].Position.Data.begin());
+    std::copy(particleData + dimension, particleData + dimension * 2, particles[i].Velocity.Data.begin());
+  }
+}
+
+template<typename Number, int Dim>
+void UnpadParticles(const Particle<Number, Dim>* particles, int dimension, long count, double* particleData)
+{
+  for (long i = 0; i < count; i++, particleData += dimension * 2)
+  {
+    std::copy(particles[i].Position.Data.begin(), particles[i].Position.Data.begin() + dimension, particleData);
+    std::copy(particles[i].Velocity.Data.begin(), particles[i].Velocity.Data.begin() + dimension, particleData + dimension);
+  }
+}
+
+// Positions of an array of particles, for kernels that can also read a bare position array
+template<typename Number, int Dim>
+struct ParticlePositions
+{
+  const Particle<Number, Dim>* Particles;
+
+  const Vector<Number, Dim>& operator [] (int i) const
+  {
+    return Particles[i].Position;
+  }
+};
+
+// Potential energy of a pair pulled together by the force factor * v, where v is
+// the distance vector and factor = coefficient * dist^(power - 1): the integral
+// coefficient * dist^(power + 1) / (power + 1), or coefficient * ln(dist) for power -1.
+// The factor is at hand in the force kernels, so this costs no extra pow.
+template<typename Number>
+Number PairPotential(Number coefficient, double power, Number dist, Number factor)
+{
+  return power == -1 ? coefficient * log(dist) : factor * dist * dist / Number(power + 1);
+}
+
+// Particle-particle forces, viscosity and gravity for the rows [begin, end).
+// Every row sums the attraction of all other particles by itself, so disjoint
+// ranges can be processed concurrently and the result does not depend on how
+// the rows are split. With potentials, row i also gets half of the potential
+// energy of its pairs, so that the rows sum to the total.
+template<typename Number, int Dim, typename Positions>
+void PairForceRows(const Positions& positions,
+  const Particle<Number, Dim>* inputs,
+  const ParticleInfo* infos,
+  int count,
+  int begin,
+  int end,
+  const Parameters& params,
+  Particle<Number, Dim>* outputs,
+  Number* potentials = nullptr)
+{
+  for (int i = begin; i < end; i++)
+  {
+    Vector<Number, Dim> force;
+    Number potential = 0;
+    const auto& position = positions[i];
+    for (int j = 0; j < count; j++)
+    {
+      if (j == i)
+        continue;
+      auto v = positions[j] - position;
+      auto dist = v.Length();
+      auto factor = params.In.ParticleAttraction * pow(dist, params.In.ParticlePower - 1);
+      v *= factor;
+      force += v * infos[j].Mass;
+      if (potentials)
+        potential += infos[j].Mass * PairPotential<Number>(params.In.ParticleAttraction, params.In.ParticlePower, dist, factor);
+    }
+    force -= inputs[i].Velocity * params.In.Viscosity;
+    force.Data[0] += params.In.Gravity;
+    outputs[i].Velocity = force;
+    outputs[i].Position = inputs[i].Velocity;
+    if (potentials)
+      potentials[i] = potential * infos[i].Mass / 2;
+  }
+}
+
+// Particle-particle forces, viscosity and gravity for all particles, visiting each
+// pair once and applying it to both ends: half the pair work of PairForceRows, but
+// serial. With potentials, particle i gets the potential energy of its pairs with
+// the particles below it.
+template<typename Number, int Dim>
+void SymmetricPairForces(const Particle<Number, Dim>* inputs,
+  const ParticleInfo* infos,
+  int count,
+  const Parameters& params,
+  Particle<Number, Dim>* outputs,
+  Number* potentials = nullptr)
+{
+  for (int i = count - 1; i >= 0; i--)
+  {
+    outputs[i].Velocity = {};
+    if (potentials)
+      potentials[i] = 0;
+  }
+  for (int i = count - 1; i >= 0; i--)
+  {
+    for (int j = i - 1; j >= 0; j--)
+    {
+      auto v = (inputs[j].Position - inputs[i].Position);
+      auto dist = v.Length();
+      auto factor = params.In.ParticleAttraction * pow(dist, params.In.ParticlePower - 1);
+      v *= factor;
+      outputs[i].Velocity += v * infos[j].Mass;
+      outputs[j].Velocity -= v * infos[i].Mass;
+      if (potentials)
+        potentials[i] += infos[i].Mass * infos[j].Mass * PairPotential<Number>(params.In.ParticleAttraction, params.In.ParticlePower, dist, factor);
+    }
+    outputs[i].Velocity -= inputs[i].Velocity * params.In.Viscosity;
+    outputs[i].Velocity.Data[0] += params.In.Gravity;
+    outputs[i].Position = inputs[i].Velocity;
+  }
+}
+
+// Share of the potential energy of a link that goes to one of its ends: half of
+// the attraction, which goes as dist^(1 - LinkPower), and the stretch term of the
+// end, which pulls A back and B forward
+template<typename Number, int Dim>
+Number LinkPotential(const Particle<Number, Dim>* inputs,
+  const ParticleInfo* infos,
+  const LinkInfo& link,
+  int end,
+  Number dist,
+  Number factor,
+  const Parameters& params)
+{
+  Number masses = infos[link.A].Mass * infos[link.B].Mass;
+  Number stretch = params.In.StretchAttraction * infos[end].Mass * inputs[end].Position.Data[0];
+  return masses * PairPotential<Number>(params.In.LinkAttraction * link.Strength, 2 - params.In.LinkPower, dist, factor) / 2 +
+    (end == link.A ? stretch : -stretch);
+}
+
+// Adds to force the link forces on particle i from its incident links
+// links[particleLinks[begin .. end)], in that order. Only particle i is written,
+// so different particles can be processed concurrently.
+template<typename Number, int Dim>
+void IncidentLinkForces(const Particle<Number, Dim>* inputs,
+  const ParticleInfo* infos,
+  const LinkInfo* links,
+  const int* particleLinks,
+  int i,
+  int begin,
+  int end,
+  const Parameters& params,
+  Vector<Number, Dim>& force,
+  Number* potential = nullptr)
+{
+  for (int k = begin; k < end; k++)
+  {
+    auto& link = links[particleLinks[k]];
+    auto v = inputs[link.B].Position - inputs[link.A].Position;
+    auto dist = v.Length();
+    auto factor = params.In.LinkAttraction * link.Strength / pow(dist, params.In.LinkPower - 1);
+    v *= factor;
+    if (link.A == i)
+    {
+      force += v * infos[link.B].Mass;
+      force.Data[0] -= params.In.StretchAttraction;
+    }
+    else
+    {
+      force -= v * infos[link.A].Mass;
+      force.Data[0] += params.In.StretchAttraction;
+    }
+    if (potential)
+      *potential += LinkPotential<Number, Dim>(inputs, infos, link, i, dist, factor, params);
+  }
+}
+
+// Adds the forces of links[0 .. linkCount) to both of their ends, in link order;
+// serial. With potential, adds the potential energy of the links to it.
+template<typename Number, int Dim>
+void SymmetricLinkForces(const Particle<Number, Dim>* inputs,
+  const ParticleInfo* infos,
+  const LinkInfo* links,
+  int linkCount,
+  const Parameters& params,
+  Particle<Number, Dim>* outputs,
+  Number* potential = nullptr)
+{
+  for (int i = 0; i < linkCount; i++)
+  {
+    auto& link = links[i];
+    auto v = inputs[link.B].Position - inputs[link.A].Position;
+    auto dist = v.Length();
+    auto factor = params.In.LinkAttraction * link.Strength / pow(dist, params.In.LinkPower - 1);
+    v *= factor;
+    outputs[link.A].Velocity += v * infos[link.B].Mass;
+    outputs[link.B].Velocity -= v * infos[link.A].Mass;
+    outputs[link.A].Velocity.Data[0] -= params.In.StretchAttraction;
+    outputs[link.B].Velocity.Data[0] += params.In.StretchAttraction;
+    if (potential)
+    {
+      *potential += LinkPotential<Number, Dim>(inputs, infos, link, link.A, dist, factor, params);
+      *potential += LinkPotential<Number, Dim>(inputs, infos, link, link.B, dist, factor, params);
+    }
+  }
+}
@@ -0,0 +1,564 @@
+#pragma once
+
+#include "FilePath.h"
+#include "Model.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+struct LayoutCacheStats
+{
+  __int64 Hits;
+  __int64 NearHits;
+  __int64 Misses;
+  __int64 Stores;
+  __int64 Evictions;
+  __int64 EntryCount;
+  __int64 Bytes;
+};
+
+// Identity of a layout problem. Hash covers the graph, the masses, the force
+// parameters and the node ids; ParamsHash only the dimension and the parameters,
+// which is what a near match must share. Fixed flags are left out: the UI sets
+// them through Sync, so the flags at Start say nothing about the layout.
+struct LayoutKey
+{
+  static const int SketchSize = 32;
+
+  uint64_t Hash = 0;
+  uint64_t ParamsHash = 0;
+  int Dimension = 0;
+  std::vector<__int64> Ids;
+  // Bottom-k sketch of the links as pairs of node ids, for near matches; empty
+  // when the caller gave no ids, since indices say nothing across graphs
+  std::vector<uint64_t> Sketch;
+
+  static LayoutKey Make(const Parameters& parameters,
+    int dimension,
+    long particleCount,
+    const ParticleInfo* particleInfos,
+    long linkCount,
+    const LinkInfo* links,
+    const __int64* particleIds)
+  {
+    LayoutKey result;
+    result.Dimension = dimension;
+    result.Algorithm = parameters.In.LayoutAlgorithm;
+    result.Ids.resize(particleCount);
+    for (long i = 0; i < particleCount; i++)
+      result.Ids[i] = particleIds ? particleIds[i] : i;
+
+    uint64_t h = Offset;
+    h = Mix(h, particleCount);
+    for (long i = 0; i < particleCount; i++)
+    {
+      h = Mix(h, result.Ids[i]);
+      h = Mix(h, particleInfos[i].Mass);
+    }
+    h = Mix(h, linkCount);
+    for (long i = 0; i < linkCount; i++)
+    {
+      h = Mix(h, links[i].A);
+      h = Mix(h, links[i].B);
+      h = Mix(h, links[i].Strength);
+    }
+    result.GraphHash = h;
+    result.Rekey(parameters);
+
+    if (particleIds)
+    {
+      for (long i = 0; i < linkCount; i++)
+      {
+        __int64 a = result.Ids[links[i].A];
+        __int64 b = result.Ids[links[i].B];
+        result.AddToSketch(Scramble(Scramble(uint64_t(std::min(a, b))) ^ uint64_t(std::max(a, b))));
+      }
+      result.Sketch.resize(SketchSize, UINT64_MAX);
+    }
+    return result;
+  }
+
+  // Files the key under other parameters, such as those a run ended with. The
+  // algorithm stays the one the engine was created for.
+  void Rekey(const Parameters& parameters)
+  {
+    // Runtime knobs (accuracy, time scale, threads...) do not change the layout
+    uint64_t h = Offset;
+    h = Mix(h, Dimension);
+    h = Mix(h, parameters.In.Viscosity);
+    h = Mix(h, parameters.In.ParticleAttraction);
+    h = Mix(h, parameters.In.ParticlePower);
+    h = Mix(h, parameters.In.LinkAttraction);
+    h = Mix(h, parameters.In.LinkPower);
+    h = Mix(h, parameters.In.StretchAttraction);
+    h = Mix(h, parameters.In.Gravity);
+    if (Algorithm != 0)
+      h = Mix(h, Algorithm);
+    ParamsHash = h;
+    Hash = Mix(h, GraphHash);
+  }
+
+private:
+  static const uint64_t Offset = 14695981039346656037ULL;
+
+  uint64_t GraphHash = 0;
+  double Algorithm = 0;
+
+  // FNV-1a over the bytes of a value
+  template<typename T>
+  static uint64_t Mix(uint64_t h, T value)
+  {
+    unsigned char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    for (auto b : bytes)
+      h = (h ^ b) * 1099511628211ULL;
+    return h;
+  }
+
+  // splitmix64 finalizer, so that the smallest hashes are a uniform sample
+  static uint64_t Scramble(uint64_t x)
+  {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  // Keeps the SketchSize smallest distinct hashes, sorted
+  void AddToSketch(uint64_t x)
+  {
+    if (Sketch.size() == size_t(SketchSize) && x >= Sketch.back())
+      return;
+    auto at = std::lower_bound(Sketch.begin(), Sketch.end(), x);
+    if (at != Sketch.end() && *at == x)
+      return;
+    Sketch.insert(at, x);
+    if (Sketch.size() > size_t(SketchSize))
+      Sketch.pop_back();
+  }
+};
+
+// On-disk cache of finished layouts, bounded in size with least recently used
+// eviction. An exact match restores the stored particles; otherwise the entry with
+// the same parameters and the most similar link set (estimated from the bottom-k
+// sketches of the keys) is used as a warm start, mapped by node id.
+class LayoutCache
+{
+public:
+  static const int SketchSize = LayoutKey::SketchSize;
+
+  bool Open(const wchar_t* directory, __int64 maxBytes)
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Directory = ToPath(directory);
+    MaxBytes = maxBytes;
+    Entries.clear();
+    Stats = LayoutCacheStats();
+    if (!MakeDirectory(Directory))
+    {
+      Directory.clear();
+      return false;
+    }
+    ListFiles(Directory, [this](const Path& name, __int64 modified)
+    {
+      Entry entry;
+      if (ReadHeader(Directory + Separator + name, entry.Header))
+      {
+        entry.Name = name;
+        entry.LastUse = modified;
+        Entries.push_back(entry);
+      }
+    });
+    Clock = 0;
+    for (auto& entry : Entries)
+      Clock = std::max(Clock, entry.LastUse);
+    Evict();
+    UpdateStats();
+    return true;
+  }
+
+  bool IsOpen()
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    return !Directory.empty();
+  }
+
+  // particleData holds Dimension * 2 numbers per particle, as passed to EngineStart.
+  // Particles without a counterpart in the cached layout are left as they are.
+  bool Lookup(const LayoutKey& key, double* particleData)
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (Directory.empty())
+      return false;
+
+    Entry* best = nullptr;
+    for (auto& entry : Entries)
+    {
+      if (entry.Header.Hash == key.Hash && entry.Header.ParticleCount == (__int64)key.Ids.size())
+      {
+        best = &entry;
+        break;
+      }
+    }
+    bool exact = best != nullptr;
+    if (!exact && !key.Sketch.empty())
+    {
+      const Sketch& sketch = key.Sketch;
+      double bestSimilarity = 0.5;
+      for (auto& entry : Entries)
+      {
+        if (entry.Header.ParamsHash != key.ParamsHash || entry.Header.Dimension != key.Dimension)
+          continue;
+        double similarity = Similarity(sketch, entry.Header.Sketch);
+        if (similarity >= bestSimilarity)
+        {
+          bestSimilarity = similarity;
+          best = &entry;
+        }
+      }
+    }
+    if (!best || !Restore(*best, key, particleData))
+    {
+      Stats.Misses++;
+      return false;
+    }
+    (exact ? Stats.Hits : Stats.NearHits)++;
+    best->LastUse = ++Clock;
+    Touch(Directory + Separator + best->Name);
+    return true;
+  }
+
+  void Store(const LayoutKey& key, const double* particleData)
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (Directory.empty())
+      return;
+
+    FileHeader header = {};
+    header.Magic = Magic;
+    header.Hash = key.Hash;
+    header.ParamsHash = key.ParamsHash;
+    header.Dimension = key.Dimension;
+    header.ParticleCount = key.Ids.size();
+    // Without a sketch the entry serves exact matches only
+    std::fill_n(header.Sketch, SketchSize, UINT64_MAX);
+    std::copy(key.Sketch.begin(), key.Sketch.end(), header.Sketch);
+
+    Path name = HexName(key.Hash);
+    Path path = Directory + Separator + name;
+    Path temporary = path + TemporarySuffix;
+    FILE* file = OpenFile(temporary, true);
+    if (!file)
+      return;
+    size_t numbers = key.Ids.size() * key.Dimension * 2;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(key.Ids.data(), sizeof(__int64), key.Ids.size(), file) == key.Ids.size()
+      && fwrite(particleData, sizeof(double), numbers, file) == numbers;
+    written = fclose(file) == 0 && written;
+    if (!written || !ReplaceFile(temporary, path))
+    {
+      RemoveFile(temporary);
+      return;
+    }
+
+    Entries.erase(std::remove_if(Entries.begin(), Entries.end(), [&](const Entry& e) { return e.Name == name; }), Entries.end());
+    Entry entry;
+    entry.Name = name;
+    entry.Header = header;
+    entry.LastUse = ++Clock;
+    Entries.push_back(entry);
+    Stats.Stores++;
+    Evict();
+    UpdateStats();
+  }
+
+  LayoutCacheStats Statistics()
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    return Stats;
+  }
+
+  static LayoutCache& Global()
+  {
+    static LayoutCache cache;
+    return cache;
+  }
+
+private:
+#ifdef _WIN32
+  typedef std::wstring Path;
+  static const wchar_t Separator = L'\\';
+  static constexpr const wchar_t* Extension = L".layout";
+  static constexpr const wchar_t* TemporarySuffix = L".tmp";
+#else
+  typedef std::string Path;
+  static const char Separator = '/';
+  static constexpr const char* Extension = ".layout";
+  static constexpr const char* TemporarySuffix = ".tmp";
+#endif
+  static const uint32_t Magic = 0x31434c48; // "HLC1"
+
+  typedef std::vector<uint64_t> Sketch;
+
+  struct FileHeader
+  {
+    uint32_t Magic;
+    int32_t Dimension;
+    uint64_t Hash;
+    uint64_t ParamsHash;
+    int64_t ParticleCount;
+    uint64_t Sketch[SketchSize];
+  };
+
+  struct Entry
+  {
+    Path Name;
+    FileHeader Header;
+    __int64 LastUse;
+  };
+
+  std::mutex Mutex;
+  Path Directory;
+  __int64 MaxBytes = 0;
+  __int64 Clock = 0;
+  std::vector<Entry> Entries;
+  LayoutCacheStats Stats = {};
+
+  static __int64 FileSize(const FileHeader& header)
+  {
+    return sizeof(FileHeader) + header.ParticleCount * (sizeof(__int64) + sizeof(double) * header.Dimension * 2);
+  }
+
+  void UpdateStats()
+  {
+    Stats.EntryCount = Entries.size();
+    Stats.Bytes = 0;
+    for (auto& entry : Entries)
+      Stats.Bytes += FileSize(entry.Header);
+  }
+
+  void Evict()
+  {
+    __int64 bytes = 0;
+    for (auto& entry : Entries)
+      bytes += FileSize(entry.Header);
+    while (bytes > MaxBytes && !Entries.empty())
+    {
+      auto oldest = std::min_element(Entries.begin(), Entries.end(), [](const Entry& a, const Entry& b) { return a.LastUse < b.LastUse; });
+      bytes -= FileSize(oldest->Header);
+      RemoveFile(Directory + Separator + oldest->Name);
+      Entries.erase(oldest);
+      Stats.Evictions++;
+    }
+  }
+
+  bool Restore(const Entry& entry, const LayoutKey& key, double* particleData)
+  {
+    FILE* file = OpenFile(Directory + Separator + entry.Name, false);
+    if (!file)
+      return false;
+    FileHeader header;
+    size_t count = size_t(entry.Header.ParticleCount);
+    size_t stride = entry.Header.Dimension * 2;
+    std::vector<__int64> ids(count);
+    std::vector<double> data(count * stride);
+    bool read = fread(&header, sizeof(header), 1, file) == 1
+      && header.Hash == entry.Header.Hash
+      && fread(ids.data(), sizeof(__int64), count, file) == count
+      && fread(data.data(), sizeof(double), data.size(), file) == data.size();
+    fclose(file);
+    if (!read)
+      return false;
+
+    if (ids == key.Ids)
+    {
+      std::copy(data.begin(), data.end(), particleData);
+      return true;
+    }
+    std::unordered_map<__int64, size_t> index;
+    for (size_t i = 0; i < count; i++)
+      index[ids[i]] = i;
+    for (size_t i = 0; i < key.Ids.size(); i++)
+    {
+      auto found = index.find(key.Ids[i]);
+      if (found != index.end())
+        std::copy_n(&data[found->second * stride], stride, particleData + i * stride);
+    }
+    return true;
+  }
+
+  // Estimated Jaccard similarity of two link sets from their bottom-k sketches
+  static double Similarity(const Sketch& a, const uint64_t* b)
+  {
+    int i = 0, j = 0, taken = 0, shared = 0;
+    while (taken < SketchSize && i < SketchSize && j < SketchSize)
+    {
+      if (a[i] == UINT64_MAX && b[j] == UINT64_MAX)
+        break;
+      if (a[i] == b[j])
+      {
+        shared++;
+        i++;
+        j++;
+      }
+      else if (a[i] < b[j])
+        i++;
+      else
+        j++;
+      taken++;
+    }
+    return taken ? double(shared) / taken : 0;
+  }
+
+  static Path HexName(uint64_t hash)
+  {
+    static const char digits[] = "0123456789abcdef";
+    Path result;
+    for (int shift = 60; shift >= 0; shift -= 4)
+      result += digits[(hash >> shift) & 15];
+    result += Extension;
+    return result;
+  }
+
+  static bool ReadHeader(const Path& path, FileHeader& header)
+  {
+    FILE* file = OpenFile(path, false);
+    if (!file)
+      return false;
+    bool result = fread(&header, sizeof(header), 1, file) == 1 && header.Magic == Magic;
+    fclose(file);
+    return result;
+  }
+
+  static bool HasExtension(const Path& name)
+  {
+    Path extension = Extension;
+    return name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0;
+  }
+
+#ifdef _WIN32
+  static Path ToPath(const wchar_t* path)
+  {
+    return path;
+  }
+
+  static bool MakeDirectory(const Path& path)
+  {
+    for (size_t pos = path.find_first_of(L"\\/", 3); ; pos = path.find_first_of(L"\\/", pos + 1))
+    {
+      CreateDirectoryW(path.substr(0, pos).c_str(), nullptr);
+      if (pos == Path::npos)
+        break;
+    }
+    DWORD attributes = GetFileAttributesW(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+  }
+
+  template<typename F>
+  static void ListFiles(const Path& directory, F f)
+  {
+    WIN32_FIND_DATAW data;
+    HANDLE find = FindFirstFileW((directory + L"\\*.layout").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+      return;
+    do
+    {
+      Path name = data.cFileName;
+      if (HasExtension(name))
+        f(name, ((__int64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+    } while (FindNextFileW(find, &data));
+    FindClose(find);
+  }
+
+  static FILE* OpenFile(const Path& path, bool write)
+  {
+    return _wfopen(path.c_str(), write ? L"wb" : L"rb");
+  }
+
+  static bool ReplaceFile(const Path& from, const Path& to)
+  {
+    return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+  }
+
+  static void RemoveFile(const Path& path)
+  {
+    _wremove(path.c_str());
+  }
+
+  static void Touch(const Path& path)
+  {
+    _wutime(path.c_str(), nullptr);
+  }
+#else
+  static Path ToPath(const wchar_t* path)
+  {
+    return NarrowPath(path);
+  }
+
+  static bool MakeDirectory(const Path& path)
+  {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+    {
+      mkdir(path.substr(0, pos).c_str(), 0777);
+      if (pos == Path::npos)
+        break;
+    }
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+  }
+
+  template<typename F>
+  static void ListFiles(const Path& directory, F f)
+  {
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+      return;
+    while (dirent* item = readdir(dir))
+    {
+      Path name = item->d_name;
+      struct stat info;
+      if (HasExtension(name) && stat((directory + Separator + name).c_str(), &info) == 0)
+        f(name, (__int64)info.st_mtime);
+    }
+    closedir(dir);
+  }
+
+  static FILE* OpenFile(const Path& path, bool write)
+  {
+    return fopen(path.c_str(), write ? "wb" : "rb");
+  }
+
+  static bool ReplaceFile(const Path& from, const Path& to)
+  {
+    return rename(from.c_str(), to.c_str()) == 0;
+  }
+
+  static void RemoveFile(const Path& path)
+  {
+    remove(path.c_str());
+  }
+
+  static void Touch(const Path& path)
+  {
+    utime(path.c_str(), nullptr);
+  }
+#endif
+};
@@ -37,11 +37,37 @@ struct Parameters
     double Gravity;
     double Accuracy;
     double TimeScale;
+    double TimeStepLevels;
+    double ThreadCount;     // 0 = the idle threads of the engine pool; read at Start
+    double MemoryPlacement; // NumaPlacement; read at Start
+    double Deterministic;
+    double FixedTimeStep;   // simulated seconds per step in deterministic mode
+    double StepLimit;       // 0 = unlimited
+    double IdleThreshold;   // speed below which the layout counts as settled; 0 = never idle
+    double IdleWakeInterval; // seconds an idle engine sleeps without input; 0 = until input
+    double LayoutAlgorithm; // 0 = force simulation, 1 = sparse stress; read at Start
+    double StressPivots;    // pivots of the sparse stress layout; read at Start
   } In;
   struct
   {
     double StepElapsedTime;
     double RealTimeScale;
     __int64 StepCount;
+    double SyncLatency;     // seconds the last sync took from the simulation thread
+    double StepJitter;      // standard deviation of the step period, in seconds
+    double IdleTime;        // seconds the simulation thread has slept idle
+    // State at the start of the last step of the force simulation
+    double PotentialEnergy;
+    double KineticEnergy;
+    double MaxResidual;     // largest net force on a non-fixed particle, viscosity aside
+    double RmsResidual;     // root mean square of the same
   } Out;
 };
+
+
+struct MemoryFootprint
+{
+  __int64 Used;
+  __int64 Reserved;
+  __int64 LargePages;
+};
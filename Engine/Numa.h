@@ -0,0 +1,176 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Where the working memory of a multithreaded engine is placed
+enum class NumaPlacement
+{
+  None = 0,         // wherever the engine thread touches it first
+  Interleaved = 1,  // 2 MB chunks spread round robin over the nodes
+  FirstTouch = 2,   // every particle range on the node of the thread that owns it
+  Replicated = 3,   // as FirstTouch, plus a per-node copy of the positions for every evaluation
+};
+
+// Processors grouped by NUMA node. On Windows a processor is encoded as group * 64 + number.
+class NumaTopology
+{
+public:
+#ifdef _WIN32
+  typedef GROUP_AFFINITY Affinity;
+#else
+  typedef cpu_set_t Affinity;
+#endif
+
+  NumaTopology()
+  {
+    Detect();
+    if (Nodes.empty())
+    {
+      int count = std::thread::hardware_concurrency();
+      Nodes.emplace_back();
+      for (int i = 0; i < (count > 0 ? count : 1); i++)
+        Nodes.back().push_back(i);
+    }
+  }
+
+  // Detected once per process: the machine does not change, and on Linux
+  // detection reads sysfs
+  static const NumaTopology& Global()
+  {
+    static const NumaTopology topology;
+    return topology;
+  }
+
+  int NodeCount() const
+  {
+    return (int)Nodes.size();
+  }
+
+  int ProcessorCount() const
+  {
+    int result = 0;
+    for (auto& node : Nodes)
+      result += (int)node.size();
+    return result;
+  }
+
+  const std::vector<int>& Processors(int node) const
+  {
+    return Nodes[node];
+  }
+
+  // Consecutive threads share a node, and every node gets an equal share of the threads
+  int NodeOfThread(int thread, int threadCount) const
+  {
+    return (int)((long long)thread * NodeCount() / threadCount);
+  }
+
+  // Pins the calling thread as the given member; returns its affinity before, for Restore
+  Affinity Pin(int thread, int threadCount) const
+  {
+    int node = NodeOfThread(thread, threadCount);
+    int first = 0;
+    while (NodeOfThread(first, threadCount) != node)
+      first++;
+    auto& processors = Nodes[node];
+    return PinToProcessor(processors[(thread - first) % processors.size()]);
+  }
+
+  static void Restore(const Affinity& affinity)
+  {
+#ifdef _WIN32
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#else
+    pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+#endif
+  }
+
+private:
+  std::vector<std::vector<int>> Nodes;
+
+#ifdef _WIN32
+  void Detect()
+  {
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest))
+      return;
+    for (ULONG node = 0; node <= highest; node++)
+    {
+      GROUP_AFFINITY affinity = {};
+      if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0)
+        continue;
+      Nodes.emplace_back();
+      for (int bit = 0; bit < 64; bit++)
+      {
+        if (affinity.Mask & (KAFFINITY(1) << bit))
+          Nodes.back().push_back(affinity.Group * 64 + bit);
+      }
+    }
+  }
+
+  static Affinity PinToProcessor(int processor)
+  {
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = (WORD)(processor / 64);
+    affinity.Mask = KAFFINITY(1) << (processor % 64);
+    GROUP_AFFINITY previous = {};
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous);
+    return previous;
+  }
+#else
+  void Detect()
+  {
+    for (int node = 0; node < 1024; node++)
+    {
+      std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      std::string list;
+      if (!std::getline(file, list))
+        continue;
+      std::vector<int> processors;
+      size_t pos = 0;
+      while (pos < list.size())
+      {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+          end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        if (!range.empty())
+        {
+          int first = std::stoi(range.substr(0, dash));
+          int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+          for (int cpu = first; cpu <= last; cpu++)
+            processors.push_back(cpu);
+        }
+        pos = end + 1;
+      }
+      if (!processors.empty())
+        Nodes.push_back(processors);
+    }
+  }
+
+  static Affinity PinToProcessor(int processor)
+  {
+    cpu_set_t previous;
+    pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(processor, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return previous;
+  }
+#endif
+};
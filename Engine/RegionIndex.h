@@ -0,0 +1,259 @@
+#pragma once
+
+#include "Model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// Arguments of a level-of-detail sync; see EngineSyncRegion and EngineSyncClusters
+struct RegionRequest
+{
+  const double* Box;            // P1 then P2, `dimension` coordinates each
+  long FixedCount;
+  const __int64* FixedIndices;
+  const double* FixedData;      // `dimension` * 2 values per fixed particle
+  long Capacity;                // particles, or clusters, that fit in the output
+  bool Clustered;
+  __int64* Indices;             // particles only
+  double* Data;
+};
+
+// Spatial index of the barrier for the level-of-detail sync, so that the cost of
+// a sync follows the particles in the box rather than the whole graph. Free
+// particles are binned on a uniform grid over their first two coordinates; the
+// others are filtered exactly. Fixed particles move with every sync, so they are
+// kept apart in a list and always tested. All calls are made under the engine
+// mutex. The engine rebuilds the index whenever it moves the free particles of
+// the barrier, but only once region syncs are in use.
+template<typename Number, int Dim>
+class RegionIndex
+{
+public:
+  using MyParticle = Particle<Number, Dim>;
+
+  bool InUse() const
+  {
+    return Used;
+  }
+
+  // After a full sync the fixed particles are whatever it said
+  void Forget()
+  {
+    FixedKnown = false;
+    Stale = true;
+  }
+
+  // Fixes exactly the requested particles in the barrier; true if anything changed
+  bool SetFixed(MyParticle* barrier, ParticleInfo* infos, int dimension, long count, const RegionRequest& request)
+  {
+    bool changed = false;
+    if (!FixedKnown)
+    {
+      Fixed.clear();
+      for (long i = 0; i < count; i++)
+      {
+        if (infos[i].Fixed)
+          Fixed.push_back(int(i));
+      }
+      FixedKnown = true;
+    }
+    for (int i : Fixed)
+      infos[i].Fixed = false;
+    std::vector<int> previous;
+    previous.swap(Fixed);
+    for (long k = 0; k < request.FixedCount; k++)
+    {
+      __int64 i = request.FixedIndices[k];
+      if (i < 0 || i >= count)
+        continue;
+      const double* data = request.FixedData + k * dimension * 2;
+      MyParticle particle = barrier[i];
+      std::copy(data, data + dimension, particle.Position.Data.begin());
+      std::copy(data + dimension, data + dimension * 2, particle.Velocity.Data.begin());
+      if (!infos[i].Fixed)
+        Fixed.push_back(int(i));
+      changed |= memcmp(&particle, &barrier[i], sizeof(MyParticle)) != 0;
+      barrier[i] = particle;
+      infos[i].Fixed = true;
+    }
+    // A particle that changes sides is binned wrong, or missing, until a rebuild
+    std::sort(Fixed.begin(), Fixed.end());
+    if (Fixed != previous)
+    {
+      Stale = true;
+      changed = true;
+    }
+    return changed;
+  }
+
+  void Build(const MyParticle* barrier, const ParticleInfo* infos, int dimension, long count)
+  {
+    Axes = std::min(dimension, 2);
+    for (int a = 0; a < Axes; a++)
+    {
+      Lo[a] = HUGE_VAL;
+      double hi = -HUGE_VAL;
+      for (long i = 0; i < count; i++)
+      {
+        double x = barrier[i].Position.Data[a];
+        if (!infos[i].Fixed && std::isfinite(x))
+        {
+          Lo[a] = std::min(Lo[a], x);
+          hi = std::max(hi, x);
+        }
+      }
+      // About two particles per cell
+      Cells[a] = Axes == 1 ? std::max(1L, count / 2) : std::max(1, int(sqrt(count / 2.0)));
+      Scale[a] = hi > Lo[a] ? Cells[a] / (hi - Lo[a]) : 0;
+      if (!(hi >= Lo[a]))
+        Lo[a] = 0;
+    }
+    if (Axes == 1)
+      Cells[1] = 1;
+
+    CellStart.assign(size_t(Cells[0]) * Cells[1] + 1, 0);
+    CellParticles.resize(count);
+    for (long i = 0; i < count; i++)
+    {
+      long cell = CellOf(barrier[i]);
+      if (!infos[i].Fixed && cell >= 0)
+        CellStart[cell + 1]++;
+    }
+    for (size_t c = 1; c < CellStart.size(); c++)
+      CellStart[c] += CellStart[c - 1];
+    std::vector<int> fill(CellStart.begin(), CellStart.end() - 1);
+    for (long i = 0; i < count; i++)
+    {
+      long cell = CellOf(barrier[i]);
+      if (!infos[i].Fixed && cell >= 0)
+        CellParticles[fill[cell]++] = int(i);
+    }
+    Stale = false;
+  }
+
+  // The particles, or clusters, in the box; returns how many there are in all
+  long Query(const MyParticle* barrier, const ParticleInfo* infos, int dimension, long count, const RegionRequest& request)
+  {
+    Used = true;
+    if (Stale)
+      Build(barrier, infos, dimension, count);
+    const double* p1 = request.Box;
+    const double* p2 = request.Box + dimension;
+
+    // Clusters are the cells of a grid over the box, as fine as the capacity allows
+    long grid[2] = { 1, 1 };
+    if (request.Clustered)
+    {
+      if (dimension == 1)
+        grid[0] = std::max(1L, request.Capacity);
+      else
+        grid[0] = grid[1] = std::max(1L, long(sqrt(double(request.Capacity))));
+      Sums.assign(size_t(grid[0]) * grid[1] * (dimension + 1), 0);
+    }
+
+    long found = 0;
+    auto visit = [&](int i)
+    {
+      auto& particle = barrier[i];
+      for (int d = 0; d < dimension; d++)
+      {
+        if (!(particle.Position.Data[d] >= p1[d] && particle.Position.Data[d] <= p2[d]))
+          return;
+      }
+      if (request.Clustered)
+      {
+        long cell = 0;
+        for (int a = 0; a < std::min(dimension, 2); a++)
+        {
+          double extent = p2[a] - p1[a];
+          long k = extent > 0 ? long((particle.Position.Data[a] - p1[a]) / extent * grid[a]) : 0;
+          cell = cell * grid[a] + std::min(k, grid[a] - 1);
+        }
+        double* sum = &Sums[cell * (dimension + 1)];
+        for (int d = 0; d < dimension; d++)
+          sum[d] += particle.Position.Data[d];
+        sum[dimension]++;
+        return;
+      }
+      if (found < request.Capacity)
+      {
+        request.Indices[found] = i;
+        double* data = request.Data + found * dimension * 2;
+        std::copy(particle.Position.Data.begin(), particle.Position.Data.begin() + dimension, data);
+        std::copy(particle.Velocity.Data.begin(), particle.Velocity.Data.begin() + dimension, data + dimension);
+      }
+      found++;
+    };
+
+    long range[2][2] = { { 0, 0 }, { 0, 0 } };
+    for (int a = 0; a < Axes; a++)
+    {
+      range[a][0] = Clamp((p1[a] - Lo[a]) * Scale[a], Cells[a]);
+      range[a][1] = Clamp((p2[a] - Lo[a]) * Scale[a], Cells[a]);
+    }
+    for (long y = range[1][0]; y <= range[1][1]; y++)
+    {
+      for (long x = range[0][0]; x <= range[0][1]; x++)
+      {
+        long cell = y * Cells[0] + x;
+        for (int k = CellStart[cell]; k < CellStart[cell + 1]; k++)
+          visit(CellParticles[k]);
+      }
+    }
+    for (int i : Fixed)
+      visit(i);
+
+    if (!request.Clustered)
+      return found;
+    long clusters = 0;
+    for (size_t cell = 0; cell < Sums.size(); cell += dimension + 1)
+    {
+      double n = Sums[cell + dimension];
+      if (n == 0)
+        continue;
+      double* out = request.Data + clusters * (dimension + 1);
+      for (int d = 0; d < dimension; d++)
+        out[d] = Sums[cell + d] / n;
+      out[dimension] = n;
+      clusters++;
+    }
+    return clusters;
+  }
+
+private:
+  bool Used = false;
+  bool Stale = true;
+  bool FixedKnown = false;
+  std::vector<int> Fixed;     // sorted
+  int Axes = 1;
+  double Lo[2] = { 0, 0 };
+  double Scale[2] = { 0, 0 };
+  long Cells[2] = { 1, 1 };
+  // Particles of cell c: CellParticles[CellStart[c] .. CellStart[c + 1])
+  std::vector<int> CellStart;
+  std::vector<int> CellParticles;
+  std::vector<double> Sums;
+
+  static long Clamp(double x, long cells)
+  {
+    if (!(x > 0))
+      return 0;
+    return x < cells - 1 ? long(x) : cells - 1;
+  }
+
+  // Row-major, like the query; -1 for a particle off the grid (not finite)
+  long CellOf(const MyParticle& particle) const
+  {
+    long index[2] = { 0, 0 };
+    for (int a = 0; a < Axes; a++)
+    {
+      double x = particle.Position.Data[a];
+      if (!std::isfinite(x))
+        return -1;
+      index[a] = Clamp((x - Lo[a]) * Scale[a], Cells[a]);
+    }
+    return index[1] * Cells[0] + index[0];
+  }
+};
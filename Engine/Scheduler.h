@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// What a slice of work reports back to the scheduler
+struct SliceResult
+{
+  __int64 Steps;
+  double SleepSeconds;  // < 0: runnable again right away; otherwise parked until woken
+                        // or this many seconds pass (HUGE_VAL: until woken)
+};
+
+// A simulation multiplexed onto the scheduler pool. Slices of one task never
+// overlap, and neither do its publishes, but a publish may run concurrently
+// with a slice of the same task.
+class Schedulable
+{
+public:
+  virtual ~Schedulable() = default;
+
+  // Runs the simulation for about the given time, but no more than maxSteps steps
+  virtual SliceResult RunSlice(double seconds, __int64 maxSteps) = 0;
+
+  virtual void RunPublish() = 0;
+};
+
+// Process-wide pool of threads shared by all the engines. Every task gets pool
+// time in proportion to its priority: the runnable task that has used the least
+// time divided by priority runs next, for one slice. A task with a step rate
+// limit is not runnable again until its last slice's steps are paid for.
+// Publish requests take precedence over slices, as they are short and the
+// snapshot pipeline waits for them. Threads with neither help out with the
+// parts of shared jobs, so the engines parallelize within the pool.
+class Scheduler
+{
+public:
+  // Short enough to keep a 30 ms sync cadence with a few tasks per pool thread
+  static constexpr double SliceSeconds = 0.005;
+
+  explicit Scheduler(int threadCount)
+  {
+    for (int i = 0; i < std::max(threadCount, 1); i++)
+      Threads.emplace_back([this]() { Work(); });
+  }
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator = (const Scheduler&) = delete;
+
+  ~Scheduler()
+  {
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      ShouldExit = true;
+    }
+    Changed.notify_all();
+    for (auto& thread : Threads)
+      thread.join();
+  }
+
+  // One thread per processor. Never destroyed: joining threads while the DLL
+  // unloads would deadlock on the loader lock.
+  static Scheduler& Global()
+  {
+    static Scheduler* scheduler = new Scheduler((int)std::thread::hardware_concurrency());
+    return *scheduler;
+  }
+
+  int ThreadCount() const
+  {
+    return (int)Threads.size();
+  }
+
+  void Add(Schedulable* task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Entries.emplace_back(new Entry());
+      auto& entry = *Entries.back();
+      entry.Task = task;
+      entry.VirtualTime = MinVirtualTime;
+    }
+    Changed.notify_all();
+  }
+
+  // Waits for a running slice or publish of the task to finish; a no-op for unknown tasks
+  void Remove(Schedulable* task)
+  {
+    std::unique_lock<std::mutex> lock(Mutex);
+    Entry* entry = Find(task);
+    if (!entry)
+      return;
+    entry->Removed = true;
+    Changed.wait(lock, [entry]() { return !entry->Stepping && !entry->Publishing; });
+    Entries.erase(std::find_if(Entries.begin(), Entries.end(), [entry](const std::unique_ptr<Entry>& e) { return e.get() == entry; }));
+  }
+
+  // Share of the pool relative to other tasks; 1 by default
+  void SetPriority(Schedulable* task, double priority)
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (Entry* entry = Find(task))
+      entry->Priority = priority > MinPriority ? priority : MinPriority;
+  }
+
+  // Steps per second; 0 = unlimited
+  void SetStepRateLimit(Schedulable* task, double stepsPerSecond)
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (Entry* entry = Find(task))
+    {
+      entry->StepRateLimit = std::max(stepsPerSecond, 0.0);
+      entry->RateEligible = Clock::time_point::min();
+    }
+    Changed.notify_all();
+  }
+
+  // Makes a parked task runnable. If the task is in a slice, its next park request is ignored.
+  void Wake(Schedulable* task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Entry* entry = Find(task);
+      if (!entry)
+        return;
+      entry->ParkedUntil = Clock::time_point::min();
+      entry->Woken = true;
+    }
+    Changed.notify_all();
+  }
+
+  // Schedules a RunPublish call; requests made before it starts are coalesced
+  void RequestPublish(Schedulable* task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Entry* entry = Find(task);
+      if (!entry)
+        return;
+      entry->PublishRequested = true;
+    }
+    Changed.notify_one();
+  }
+
+  // Runs part(0) .. part(count - 1) and returns when all are done. The caller runs
+  // parts too, and pool threads that have no publish or slice to run take the
+  // others, one at a time. A part is only ever waited for while a thread runs it,
+  // so a busy pool makes the job serial instead of adding threads.
+  void Share(int count, const std::function<void(int)>& part)
+  {
+    Job job = { &part, count, 0, 0 };
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Jobs.push_back(&job);
+    }
+    Changed.notify_all();
+    std::unique_lock<std::mutex> lock(Mutex);
+    for (;;)
+    {
+      int index = Claim(job);
+      if (index < 0)
+        break;
+      lock.unlock();
+      part(index);
+      lock.lock();
+    }
+    Changed.wait(lock, [&job]() { return job.Running == 0; });
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  static constexpr double MinPriority = 0.01;
+
+  struct Entry
+  {
+    Schedulable* Task = nullptr;
+    double Priority = 1;
+    double StepRateLimit = 0;
+    double VirtualTime = 0;  // pool seconds used divided by Priority
+    Clock::time_point RateEligible = Clock::time_point::min();
+    Clock::time_point ParkedUntil = Clock::time_point::min();
+    bool Parked = false;
+    bool Woken = false;
+    bool Stepping = false;
+    bool PublishRequested = false;
+    bool Publishing = false;
+    bool Removed = false;
+  };
+
+  struct Job
+  {
+    const std::function<void(int)>* Part;
+    int Count;
+    int Next;     // first part not claimed yet
+    int Running;  // parts claimed by pool threads and not finished
+  };
+
+  std::vector<std::thread> Threads;
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::vector<std::unique_ptr<Entry>> Entries;
+  // Shared jobs with parts left to claim
+  std::vector<Job*> Jobs;
+  // Virtual time of the last task picked. Tasks that join or leave the park start
+  // from here, so that time spent away does not turn into a burst of slices.
+  double MinVirtualTime = 0;
+  bool ShouldExit = false;
+
+  Entry* Find(Schedulable* task)
+  {
+    for (auto& entry : Entries)
+    {
+      if (entry->Task == task && !entry->Removed)
+        return entry.get();
+    }
+    return nullptr;
+  }
+
+  // Next part of the job, or -1 when all are claimed; called under Mutex
+  int Claim(Job& job)
+  {
+    if (job.Next == job.Count)
+      return -1;
+    int index = job.Next++;
+    if (job.Next == job.Count)
+      Jobs.erase(std::find(Jobs.begin(), Jobs.end(), &job));
+    return index;
+  }
+
+  static Clock::time_point After(Clock::time_point time, double seconds)
+  {
+    if (std::isinf(seconds))
+      return Clock::time_point::max();
+    return time + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+  }
+
+  void Work()
+  {
+    std::unique_lock<std::mutex> lock(Mutex);
+    while (!ShouldExit)
+    {
+      auto now = Clock::now();
+      Entry* publish = nullptr;
+      Entry* slice = nullptr;
+      auto wakeup = Clock::time_point::max();
+      for (auto& entry : Entries)
+      {
+        if (entry->Removed)
+          continue;
+        if (entry->PublishRequested && !entry->Publishing)
+        {
+          publish = entry.get();
+          break;
+        }
+        if (entry->Stepping)
+          continue;
+        auto eligible = std::max(entry->RateEligible, entry->ParkedUntil);
+        if (eligible > now)
+        {
+          wakeup = std::min(wakeup, eligible);
+          continue;
+        }
+        if (!slice || entry->VirtualTime < slice->VirtualTime)
+          slice = entry.get();
+      }
+
+      if (publish)
+      {
+        publish->PublishRequested = false;
+        publish->Publishing = true;
+        lock.unlock();
+        publish->Task->RunPublish();
+        lock.lock();
+        publish->Publishing = false;
+        Changed.notify_all();
+      }
+      else if (slice)
+      {
+        if (slice->Parked)
+        {
+          slice->Parked = false;
+          slice->VirtualTime = std::max(slice->VirtualTime, MinVirtualTime);
+        }
+        MinVirtualTime = slice->VirtualTime;
+        slice->Stepping = true;
+        slice->Woken = false;
+        __int64 maxSteps = LLONG_MAX;
+        if (slice->StepRateLimit > 0)
+          maxSteps = std::max<__int64>(1, (__int64)(slice->StepRateLimit * SliceSeconds));
+        lock.unlock();
+        auto start = Clock::now();
+        SliceResult result = slice->Task->RunSlice(SliceSeconds, maxSteps);
+        auto end = Clock::now();
+        lock.lock();
+        slice->VirtualTime += std::chrono::duration<double>(end - start).count() / slice->Priority;
+        // Steps are paid for from when the last ones were, so that the delay of a
+        // busy pool does not lower the rate, but at most one slice of it is made up
+        if (slice->StepRateLimit > 0)
+          slice->RateEligible = After(std::max(slice->RateEligible, After(start, -SliceSeconds)), result.Steps / slice->StepRateLimit);
+        if (result.SleepSeconds >= 0 && !slice->Woken)
+        {
+          slice->Parked = true;
+          slice->ParkedUntil = After(end, result.SleepSeconds);
+        }
+        slice->Stepping = false;
+        Changed.notify_all();
+      }
+      else if (!Jobs.empty())
+      {
+        Job& job = *Jobs.front();
+        int index = Claim(job);
+        job.Running++;
+        lock.unlock();
+        (*job.Part)(index);
+        lock.lock();
+        if (--job.Running == 0)
+          Changed.notify_all();
+      }
+      else if (wakeup == Clock::time_point::max())
+      {
+        Changed.wait(lock);
+      }
+      else
+      {
+        Changed.wait_until(lock, wakeup);
+      }
+    }
+  }
+};
@@ -1,6 +1,8 @@
 #pragma once
 
-#include <memory>
+#include "Arena.h"
+
+#include <cmath>
 #include <functional>
 
 template<typename Number>
@@ -8,13 +10,17 @@ class BasicSolver
 {
 public:
   typedef std::function<void(const Number*, Number*)> CalcFunction;
-  virtual void Initialize(int n, Number* y, CalcFunction func)
+  virtual void Initialize(Arena& /*arena*/, int n, Number* y, CalcFunction func)
   {
     N = n;
     Y = y;
     Function = func;
   }
   virtual double Step(double dt, double accuracy) = 0;
+  // Writes the work buffers in [begin, end) so their pages are placed at the calling thread
+  virtual void Touch(int /*begin*/, int /*end*/)
+  {
+  }
 protected:
   int N;
   Number* Y;
@@ -37,27 +43,38 @@ template<typename Number>
 class EulerSolver : public BasicSolver < Number >
 {
 public:
-  virtual void Initialize(int n, Number* y, CalcFunction func)
+  using typename BasicSolver<Number>::CalcFunction;
+  using BasicSolver<Number>::N;
+  using BasicSolver<Number>::Y;
+  using BasicSolver<Number>::Function;
+  using BasicSolver<Number>::Distance;
+
+  virtual void Initialize(Arena& arena, int n, Number* y, CalcFunction func)
   {
-    BasicSolver::Initialize(n, y, func);
-    FY.reset(new Number[N]);
-    Y1.reset(new Number[N]);
-    FY1.reset(new Number[N]);
+    BasicSolver<Number>::Initialize(arena, n, y, func);
+    FY = arena.Allocate<Number>(N);
+    Y1 = arena.Allocate<Number>(N);
+    FY1 = arena.Allocate<Number>(N);
     LastDt = 0.001;
   }
+  virtual void Touch(int begin, int end)
+  {
+    for (int i = begin; i < end; i++)
+      FY[i] = Y1[i] = FY1[i] = 0;
+  }
   virtual double Step(double dt, double accuracy)
   {
     if (dt > LastDt * 2)
       dt = LastDt * 2;
 
-    Function(Y, FY.get());
+    Function(Y, FY);
     for (;;)
     {
       for (int i = 0; i < N; i++)
         Y1[i] = Y[i] + FY[i] * dt;
-      Function(Y1.get(), FY1.get());
+      Function(Y1, FY1);
 
-      if (Distance(FY1.get(), FY.get()) < accuracy)
+      if (Distance(FY1, FY) < accuracy)
         break;
       dt /= 2;
     }
@@ -67,58 +84,227 @@ public:
     return dt;
   }
 protected:
-  std::unique_ptr<Number[]> Y1;
-  std::unique_ptr<Number[]> FY;
-  std::unique_ptr<Number[]> FY1;
+  Number* Y1;
+  Number* FY;
+  Number* FY1;
   double LastDt;
 };
 
+// Euler solver with block time steps. Every block of BlockSize numbers (one particle)
+// gets its own power-of-two step level, so a few stiff particles are substepped
+// while the rest of the system advances with the full step.
+template<typename Number>
+class BlockEulerSolver : public EulerSolver < Number >
+{
+public:
+  typedef std::function<void(const Number*, Number*, const int*, int)> PartialCalcFunction;
+
+  using typename BasicSolver<Number>::CalcFunction;
+  using BasicSolver<Number>::N;
+  using BasicSolver<Number>::Y;
+  using BasicSolver<Number>::Function;
+  using EulerSolver<Number>::Y1;
+  using EulerSolver<Number>::FY;
+  using EulerSolver<Number>::FY1;
+  using EulerSolver<Number>::LastDt;
+
+  static const int LevelLimit = 16;
+
+  virtual void Initialize(Arena& arena, int n, Number* y, CalcFunction func)
+  {
+    Initialize(arena, n, y, func, n, [func](const Number* y, Number* fy, const int*, int) { func(y, fy); });
+  }
+  void Initialize(Arena& arena, int n, Number* y, CalcFunction func, int blockSize, PartialCalcFunction partialFunc)
+  {
+    EulerSolver<Number>::Initialize(arena, n, y, func);
+    BlockSize = blockSize;
+    BlockCount = n / blockSize;
+    PartialFunction = partialFunc;
+    Pred = arena.Allocate<Number>(N);
+    Levels = arena.Allocate<int>(BlockCount);
+    Times = arena.Allocate<int>(BlockCount);
+    Active = arena.Allocate<int>(BlockCount);
+    MaxLevel = 0;
+    DeepestLevel = 0;
+  }
+  virtual void Touch(int begin, int end)
+  {
+    EulerSolver<Number>::Touch(begin, end);
+    for (int i = begin; i < end; i++)
+      Pred[i] = 0;
+  }
+  void SetMaxLevel(int maxLevel)
+  {
+    MaxLevel = maxLevel < 0 ? 0 : maxLevel > LevelLimit ? LevelLimit : maxLevel;
+  }
+  int GetDeepestLevel() const
+  {
+    return DeepestLevel;
+  }
+  virtual double Step(double dt, double accuracy)
+  {
+    DeepestLevel = 0;
+    if (MaxLevel == 0 || BlockCount == 0)
+      return EulerSolver<Number>::Step(dt, accuracy);
+
+    if (dt > LastDt * 2)
+      dt = LastDt * 2;
+
+    Function(Y, FY);
+    for (;;)
+    {
+      for (int i = 0; i < N; i++)
+        Y1[i] = Y[i] + FY[i] * dt;
+      Function(Y1, FY1);
+
+      DeepestLevel = AssignLevels(accuracy);
+      if (DeepestLevel <= MaxLevel)
+        break;
+      dt /= 2;
+    }
+    LastDt = dt;
+
+    if (DeepestLevel == 0)
+    {
+      for (int i = 0; i < N; i++)
+        Y[i] += (FY[i] + FY1[i]) / 2 * dt;
+      return dt;
+    }
+
+    // Substeps are counted in units of the finest step. A block on level L steps
+    // every 2^(DeepestLevel - L) substeps; the others are predicted linearly from
+    // their last derivative while the active ones are evaluated and corrected.
+    int substepCount = 1 << DeepestLevel;
+    double h = dt / substepCount;
+    for (int b = 0; b < BlockCount; b++)
+      Times[b] = 0;
+    for (int s = 1; s <= substepCount; s++)
+    {
+      int activeCount = 0;
+      for (int b = 0; b < BlockCount; b++)
+      {
+        if (s % (1 << (DeepestLevel - Levels[b])) == 0)
+          Active[activeCount++] = b;
+      }
+      for (int b = 0; b < BlockCount; b++)
+      {
+        double elapsed = (s - Times[b]) * h;
+        for (int i = b * BlockSize, end = i + BlockSize; i < end; i++)
+          Pred[i] = Y[i] + FY[i] * elapsed;
+      }
+      PartialFunction(Pred, FY1, Active, activeCount);
+      for (int a = 0; a < activeCount; a++)
+      {
+        int b = Active[a];
+        double elapsed = (s - Times[b]) * h;
+        for (int i = b * BlockSize, end = i + BlockSize; i < end; i++)
+        {
+          Y[i] += (FY[i] + FY1[i]) / 2 * elapsed;
+          FY[i] = FY1[i];
+        }
+        Times[b] = s;
+      }
+    }
+    return dt;
+  }
+protected:
+  int BlockSize;
+  int BlockCount;
+  int MaxLevel;
+  int DeepestLevel;
+  PartialCalcFunction PartialFunction;
+  Number* Pred;
+  int* Levels;
+  int* Times;
+  int* Active;
+
+  // The derivative change over a trial step is proportional to the step, so every
+  // halving halves the local error. Per-block tolerance is scaled so that a system
+  // with all blocks on level 0 passes the same global test as EulerSolver.
+  int AssignLevels(double accuracy)
+  {
+    double tolerance = accuracy / sqrt(double(BlockCount));
+    int deepest = 0;
+    for (int b = 0; b < BlockCount; b++)
+    {
+      Number error = 0;
+      for (int i = b * BlockSize, end = i + BlockSize; i < end; i++)
+      {
+        Number x = FY1[i] - FY[i];
+        error += x * x;
+      }
+      double e = sqrt(error);
+      int level = 0;
+      while (e >= tolerance && level <= MaxLevel)
+      {
+        e /= 2;
+        level++;
+      }
+      Levels[b] = level;
+      if (level > deepest)
+        deepest = level;
+    }
+    return deepest;
+  }
+};
+
 template<typename Number>
 class RungeKuttaSolver : public BasicSolver < Number >
 {
 public:
-  virtual void Initialize(int n, Number* y, CalcFunction func)
+  using typename BasicSolver<Number>::CalcFunction;
+  using BasicSolver<Number>::N;
+  using BasicSolver<Number>::Y;
+  using BasicSolver<Number>::Function;
+  using BasicSolver<Number>::Distance;
+
+  virtual void Initialize(Arena& arena, int n, Number* y, CalcFunction func)
+  {
+    BasicSolver<Number>::Initialize(arena, n, y, func);
+    Y1 = arena.Allocate<Number>(N);
+    Y2 = arena.Allocate<Number>(N);
+    Y3 = arena.Allocate<Number>(N);
+    Y4 = arena.Allocate<Number>(N);
+    Tmp = arena.Allocate<Number>(N);
+  }
+  virtual void Touch(int begin, int end)
   {
-    BasicSolver::Initialize(n, y, func);
-    Y1.reset(new Number[N]);
-    Y2.reset(new Number[N]);
-    Y3.reset(new Number[N]);
-    Y4.reset(new Number[N]);
-    Tmp.reset(new Number[N]);
+    for (int i = begin; i < end; i++)
+      Y1[i] = Y2[i] = Y3[i] = Y4[i] = Tmp[i] = 0;
   }
   virtual double Step(double dt, double accuracy)
   {
-    Function(Y, Y1.get());
+    Function(Y, Y1);
     for (;;)
     {
       for (int i = 0; i < N; i++)
         Y2[i] = Y[i] + Y1[i] * dt;
-      Function(Y2.get(), Y3.get());
+      Function(Y2, Y3);
 
-      if (Distance(Y3.get(), Y1.get()) < accuracy)
+      if (Distance(Y3, Y1) < accuracy)
         break;
       dt /= 2;
     }
 
-    //		Function(Y, Y1.get());
+    //		Function(Y, Y1);
     for (int i = 0; i < N; i++)
       Tmp[i] = Y[i] + Y1[i] * dt / 2.0;
-    Function(Tmp.get(), Y2.get());
+    Function(Tmp, Y2);
     for (int i = 0; i < N; i++)
       Tmp[i] = Y[i] + Y2[i] * dt / 2.0;
-    Function(Tmp.get(), Y3.get());
+    Function(Tmp, Y3);
     for (int i = 0; i < N; i++)
       Tmp[i] = Y[i] + Y3[i] * dt;
-    Function(Tmp.get(), Y4.get());
+    Function(Tmp, Y4);
     for (int i = 0; i < N; i++)
       Y[i] = Y[i] + dt / 6.0 * (Y1[i] + 2.0 * Y2[i] + 2.0 * Y3[i] + Y4[i]);
     return dt;
   }
 protected:
-  std::unique_ptr<Number[]> Y1;
-  std::unique_ptr<Number[]> Y2;
-  std::unique_ptr<Number[]> Y3;
-  std::unique_ptr<Number[]> Y4;
-  std::unique_ptr<Number[]> Tmp;
+  Number* Y1;
+  Number* Y2;
+  Number* Y3;
+  Number* Y4;
+  Number* Tmp;
 };
 
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "Engine.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+// Static layout by sparse stress majorization (Ortmann, Klimenta, Brandes).
+// Every link wants its particles one unit apart. Instead of the distances between
+// all pairs, every particle is also pulled towards a set of pivots at their
+// graph distance, weighted by how many particles the pivot stands for, which
+// keeps memory at O(N * pivots). An iteration moves every particle to the
+// weighted average of where its terms want it, from the previous positions only,
+// so the particle ranges of the team are updated independently.
+//
+// Fixed particles are terms for the others but are never moved. Unconnected
+// parts of the graph are laid out independently of each other.
+template<typename Number, int Dim>
+class StressEngine: public EngineBase
+{
+public:
+  using MyParticle = Particle<Number, Dim>;
+  using MyVector = Vector<Number, Dim>;
+
+  explicit StressEngine(int dimension = Dim)
+  {
+    Dimension = dimension;
+  }
+
+  ~StressEngine()
+  {
+    Stop();
+  }
+
+  virtual void Start(Parameters& parameters,
+    long particleCount,
+    double* particleData,
+    ParticleInfo* particleInfos,
+    long linkCount,
+    LinkInfo* links) override
+  {
+    Params = parameters;
+    BarrierParams = parameters;
+    ParticleCount = particleCount;
+    LinkCount = linkCount;
+
+    if (Dimension == Dim)
+    {
+      Initialize(reinterpret_cast<const MyParticle*>(particleData), particleInfos, links);
+    }
+    else
+    {
+      std::vector<MyParticle> particles(ParticleCount);
+      PadParticles(particleData, Dimension, ParticleCount, particles.data());
+      Initialize(particles.data(), particleInfos, links);
+    }
+    Converged = false;
+    Sleeping = false;
+    LastStress = HUGE_VAL;
+    SyncStopwatch.Reset();
+    Scheduler::Global().Add(this);
+  }
+
+  virtual void Sync(Parameters& parameters, double* particleData, ParticleInfo* particleInfos) override
+  {
+    SyncPadded<Number, Dim>(particleData, [&](MyParticle* particles)
+    {
+      SyncParticles(parameters, particles, particleInfos);
+    });
+  }
+
+  virtual long SyncRegion(Parameters& parameters, const RegionRequest& request) override
+  {
+    return ExchangeRegion(parameters, request, BarrierParticles, ParticleInfos, Region);
+  }
+
+  virtual void ReadParticles(double* particleData) const override
+  {
+    std::vector<MyParticle> particles(ParticleCount);
+    for (long i = 0; i < ParticleCount; i++)
+      particles[i].Position = Positions[i];
+    UnpadParticles(particles.data(), Dimension, ParticleCount, particleData);
+  }
+
+  virtual bool IsSettled() const override
+  {
+    return Converged;
+  }
+
+  // Iterations are cheap to publish, so the barrier is exchanged in the slice
+  virtual void RunPublish() override
+  {}
+
+  virtual SliceResult RunSlice(double seconds, __int64 maxSteps) override
+  {
+    SliceResult result = { 0, -1 };
+    if (Sleeping)
+    {
+      Params.Out.IdleTime += IdleStopwatch.Seconds();
+      Sleeping = false;
+      Converged = false;
+      LastStress = HUGE_VAL;
+    }
+    // Fixed particles and parameters from Sync
+    Exchange();
+
+    StopWatch stopwatchSlice;
+    for (;;)
+    {
+      bool limitReached = Params.In.StepLimit > 0 && Params.Out.StepCount >= Params.In.StepLimit;
+      if (Converged || limitReached)
+      {
+        Exchange();
+        Sleeping = true;
+        IdleStopwatch.Reset();
+        result.SleepSeconds = HUGE_VAL;
+        return result;
+      }
+
+      StopWatch stopwatch;
+      Number stress = Iterate();
+      // A relative test never passes at zero stress, where the layout is exact
+      Converged = stress == 0 || LastStress - stress < ConvergenceTolerance * LastStress;
+      LastStress = stress;
+      Params.Out.StepCount++;
+      Params.Out.StepElapsedTime = stopwatch.Seconds();
+
+      if (SyncStopwatch.Seconds() > 0.030)
+        Exchange();
+      if (++result.Steps >= maxSteps || stopwatchSlice.Seconds() >= seconds)
+        return result;
+    }
+  }
+
+private:
+  // Relative decrease of the stress by an iteration below which the layout is done.
+  // Not the moves: sparse stress terms are not symmetric, and the layout as a
+  // whole may keep drifting when its shape has long settled.
+  static const Number ConvergenceTolerance;
+
+  // Positions being improved, and the next iteration's
+  MyVector* Positions;
+  MyVector* NextPositions;
+  ParticleInfo* ParticleInfos;
+  MyParticle* BarrierParticles;
+  RegionIndex<Number, Dim> Region;
+  // Fixed flags as of the last Exchange. Sync writes those of ParticleInfos under
+  // Mutex, so the iterations read these.
+  bool* Fixed;
+
+  // Neighbours of each particle: Neighbours[NeighbourOffsets[i] .. NeighbourOffsets[i + 1])
+  int* NeighbourOffsets;
+  int* Neighbours;
+
+  // Row p holds the graph distance of every particle from pivot p (-1 if
+  // unreachable) and the weight of its term
+  int PivotCount;
+  int* Pivots;
+  int* PivotDistances;
+  Number* PivotWeights;
+
+  ThreadTeam Team;
+  std::vector<int> Partition;
+  // Stress of every particle's terms, summed serially so that convergence does
+  // not depend on the number of threads
+  Number* ParticleStress;
+
+  StopWatch SyncStopwatch;
+  StopWatch IdleStopwatch;
+  Number LastStress;
+  bool Converged;
+  bool Sleeping;
+
+  void Initialize(const MyParticle* particles, const ParticleInfo* particleInfos, const LinkInfo* links)
+  {
+    // By default the team borrows idle threads of the engine pool
+    int threadCount = int(Params.In.ThreadCount);
+    if (threadCount <= 0)
+      Team.StartShared(Scheduler::Global().ThreadCount(), Scheduler::Global());
+    else
+      Team.Start(threadCount, nullptr, false);
+    Partition.resize(Team.Size() + 1);
+    for (int t = 0; t <= Team.Size(); t++)
+      Partition[t] = int((long long)ParticleCount * t / Team.Size());
+
+    PivotCount = int(std::min<double>(std::max(Params.In.StressPivots, 1.0), double(ParticleCount)));
+    Positions = Memory.Allocate<MyVector>(ParticleCount);
+    NextPositions = Memory.Allocate<MyVector>(ParticleCount);
+    ParticleStress = Memory.Allocate<Number>(ParticleCount);
+    ParticleInfos = Memory.Allocate<ParticleInfo>(ParticleCount);
+    Fixed = Memory.Allocate<bool>(ParticleCount);
+    BarrierParticles = Memory.Allocate<MyParticle>(ParticleCount);
+    NeighbourOffsets = Memory.Allocate<int>(ParticleCount + 1);
+    Neighbours = Memory.Allocate<int>(LinkCount * 2);
+    Pivots = Memory.Allocate<int>(PivotCount);
+    PivotDistances = Memory.Allocate<int>((size_t)PivotCount * ParticleCount);
+    PivotWeights = Memory.Allocate<Number>((size_t)PivotCount * ParticleCount);
+
+    for (long i = 0; i < ParticleCount; i++)
+    {
+      Positions[i] = particles[i].Position;
+      ParticleInfos[i] = particleInfos[i];
+      Fixed[i] = particleInfos[i].Fixed;
+      BarrierParticles[i].Position = particles[i].Position;
+      BarrierParticles[i].Velocity = MyVector();
+    }
+    BuildNeighbours(links);
+    ChoosePivots();
+    WeighPivots();
+  }
+
+  void BuildNeighbours(const LinkInfo* links)
+  {
+    std::fill(NeighbourOffsets, NeighbourOffsets + ParticleCount + 1, 0);
+    for (long k = 0; k < LinkCount; k++)
+    {
+      NeighbourOffsets[links[k].A + 1]++;
+      NeighbourOffsets[links[k].B + 1]++;
+    }
+    for (long i = 0; i < ParticleCount; i++)
+      NeighbourOffsets[i + 1] += NeighbourOffsets[i];
+    std::vector<int> fill(NeighbourOffsets, NeighbourOffsets + ParticleCount);
+    for (long k = 0; k < LinkCount; k++)
+    {
+      Neighbours[fill[links[k].A]++] = links[k].B;
+      Neighbours[fill[links[k].B]++] = links[k].A;
+    }
+  }
+
+  void BreadthFirst(int source, int* distances) const
+  {
+    std::fill(distances, distances + ParticleCount, -1);
+    std::vector<int> queue(1, source);
+    distances[source] = 0;
+    for (size_t head = 0; head < queue.size(); head++)
+    {
+      int i = queue[head];
+      for (int k = NeighbourOffsets[i]; k < NeighbourOffsets[i + 1]; k++)
+      {
+        int j = Neighbours[k];
+        if (distances[j] < 0)
+        {
+          distances[j] = distances[i] + 1;
+          queue.push_back(j);
+        }
+      }
+    }
+  }
+
+  // Max-min selection: every next pivot is the particle farthest from the pivots
+  // so far. Particles no pivot reaches count as the farthest, so that every part
+  // of the graph gets pivots.
+  void ChoosePivots()
+  {
+    std::vector<int> nearest(ParticleCount, INT_MAX);
+    int next = 0;
+    for (int p = 0; p < PivotCount; p++)
+    {
+      Pivots[p] = next;
+      int* row = PivotDistances + (size_t)p * ParticleCount;
+      BreadthFirst(next, row);
+      int farthest = -1;
+      for (long i = 0; i < ParticleCount; i++)
+      {
+        if (row[i] >= 0)
+          nearest[i] = std::min(nearest[i], row[i]);
+        if (nearest[i] > farthest)
+        {
+          farthest = nearest[i];
+          next = int(i);
+        }
+      }
+    }
+  }
+
+  // The term of particle i and pivot p stands for the particles of p's region (those
+  // closer to p than to any other pivot) at most half as far from p as i is
+  void WeighPivots()
+  {
+    std::vector<int> region(ParticleCount, -1);
+    for (long i = 0; i < ParticleCount; i++)
+    {
+      int best = INT_MAX;
+      for (int p = 0; p < PivotCount; p++)
+      {
+        int d = PivotDistances[(size_t)p * ParticleCount + i];
+        if (d >= 0 && d < best)
+        {
+          best = d;
+          region[i] = p;
+        }
+      }
+    }
+    std::vector<std::vector<int>> regionDistances(PivotCount);
+    for (long i = 0; i < ParticleCount; i++)
+    {
+      if (region[i] >= 0)
+        regionDistances[region[i]].push_back(PivotDistances[(size_t)region[i] * ParticleCount + i]);
+    }
+    for (auto& distances : regionDistances)
+      std::sort(distances.begin(), distances.end());
+
+    Team.Run([&](int thread)
+    {
+      for (int p = 0; p < PivotCount; p++)
+      {
+        const int* distances = PivotDistances + (size_t)p * ParticleCount;
+        Number* weights = PivotWeights + (size_t)p * ParticleCount;
+        auto& sorted = regionDistances[p];
+        for (int i = Partition[thread]; i < Partition[thread + 1]; i++)
+        {
+          int d = distances[i];
+          if (d <= 0)
+          {
+            weights[i] = 0;
+            continue;
+          }
+          auto count = std::upper_bound(sorted.begin(), sorted.end(), d / 2) - sorted.begin();
+          weights[i] = Number(count) / (Number(d) * d);
+        }
+      }
+    });
+  }
+
+  // Adds the term that wants particle i at distance d from `other`
+  static void AddTerm(const MyVector& position, const MyVector& other, Number d, Number weight, MyVector& sum, Number& weights, Number& stress)
+  {
+    auto v = position - other;
+    auto length = v.Length();
+    auto target = other;
+    if (length > 0)
+      target += v * (d / length);
+    sum += target * weight;
+    weights += weight;
+    stress += weight * (length - d) * (length - d);
+  }
+
+  // One Jacobi iteration; returns the stress of the positions it started from
+  Number Iterate()
+  {
+    Team.Run([this](int thread)
+    {
+      for (int i = Partition[thread]; i < Partition[thread + 1]; i++)
+      {
+        const auto& position = Positions[i];
+        ParticleStress[i] = 0;
+        if (Fixed[i])
+        {
+          NextPositions[i] = position;
+          continue;
+        }
+        MyVector sum;
+        Number weights = 0;
+        Number& stress = ParticleStress[i];
+        for (int k = NeighbourOffsets[i]; k < NeighbourOffsets[i + 1]; k++)
+          AddTerm(position, Positions[Neighbours[k]], 1, 1, sum, weights, stress);
+        for (int p = 0; p < PivotCount; p++)
+        {
+          Number weight = PivotWeights[(size_t)p * ParticleCount + i];
+          if (weight > 0)
+            AddTerm(position, Positions[Pivots[p]], Number(PivotDistances[(size_t)p * ParticleCount + i]), weight, sum, weights, stress);
+        }
+        if (weights > 0)
+          sum *= 1 / weights;
+        else
+          sum = position;
+        NextPositions[i] = sum;
+      }
+    });
+    std::swap(Positions, NextPositions);
+    Number stress = 0;
+    for (long i = 0; i < ParticleCount; i++)
+      stress += ParticleStress[i];
+    return stress;
+  }
+
+  void Exchange()
+  {
+    StopWatch stopwatch;
+    std::lock_guard<std::mutex> lock(Mutex);
+
+    for (long i = 0; i < ParticleCount; i++)
+    {
+      Fixed[i] = ParticleInfos[i].Fixed;
+      if (Fixed[i])
+        Positions[i] = BarrierParticles[i].Position;
+      else
+        BarrierParticles[i].Position = Positions[i];
+    }
+    if (Region.InUse())
+      Region.Build(BarrierParticles, ParticleInfos, Dimension, ParticleCount);
+    memcpy(&Params.In, &BarrierParams.In, sizeof(Params.In));
+    Params.Out.SyncLatency = stopwatch.Seconds();
+    memcpy(&BarrierParams.Out, &Params.Out, sizeof(Params.Out));
+    SyncStopwatch.Reset();
+  }
+
+  void SyncParticles(Parameters& parameters, MyParticle* particles, const ParticleInfo* particleInfos)
+  {
+    std::unique_lock<std::mutex> lock(Mutex);
+
+    bool changed = memcmp(&BarrierParams.In, &parameters.In, sizeof(Params.In)) != 0;
+    Region.Forget();
+    for (long i = 0; i < ParticleCount; i++)
+    {
+      if (ParticleInfos[i].Fixed != particleInfos[i].Fixed)
+        changed = true;
+      ParticleInfos[i].Fixed = particleInfos[i].Fixed;
+      if (ParticleInfos[i].Fixed)
+      {
+        if (memcmp(&BarrierParticles[i].Position, &particles[i].Position, sizeof(MyVector)) != 0)
+          changed = true;
+        BarrierParticles[i].Position = particles[i].Position;
+      }
+      else
+      {
+        particles[i].Position = BarrierParticles[i].Position;
+      }
+      particles[i].Velocity = MyVector();
+    }
+
+    memcpy(&BarrierParams.In, &parameters.In, sizeof(Params.In));
+    memcpy(&parameters.Out, &BarrierParams.Out, sizeof(Params.Out));
+    lock.unlock();
+    if (changed)
+      Scheduler::Global().Wake(this);
+  }
+};
+
+template<typename Number, int Dim>
+const Number StressEngine<Number, Dim>::ConvergenceTolerance = Number(1e-4);
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "Arena.h"
+#include "Numa.h"
+#include "Scheduler.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed group of threads running one task at a time in fork-join fashion.
+// The thread that starts the team takes part as member 0, so a team of one
+// runs every task inline without any synchronization. A shared team has no
+// threads of its own: its members are parts of a Scheduler::Share job.
+class ThreadTeam
+{
+public:
+  typedef std::function<void(int)> Task;
+
+  ThreadTeam() = default;
+  ThreadTeam(const ThreadTeam&) = delete;
+  ThreadTeam& operator = (const ThreadTeam&) = delete;
+
+  ~ThreadTeam()
+  {
+    Stop();
+  }
+
+  // With a topology every member is pinned to a processor. With pinCaller the
+  // caller is pinned for good, in which case Start must be called from the thread
+  // that is going to call Run. Otherwise member 0 may be a different thread every
+  // time, and Run pins it for the task only.
+  void Start(int threadCount, const NumaTopology* topology, bool pinCaller = true)
+  {
+    Stop();
+    Count = threadCount < 1 ? 1 : threadCount;
+    Topology = topology;
+    PinsCaller = pinCaller;
+    if (Topology && pinCaller)
+      Topology->Pin(0, Count);
+    ShouldExit = false;
+    unsigned generation = Generation;
+    for (int i = 1; i < Count; i++)
+    {
+      Threads.emplace_back([this, i, generation]()
+      {
+        if (Topology)
+          Topology->Pin(i, Count);
+        Work(i, generation);
+      });
+    }
+  }
+
+  // Members are run by whichever threads of the pool are free, unpinned
+  void StartShared(int memberCount, Scheduler& pool)
+  {
+    Stop();
+    Count = memberCount < 1 ? 1 : memberCount;
+    Pool = &pool;
+  }
+
+  void Stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      ShouldExit = true;
+    }
+    Started.notify_all();
+    for (auto& thread : Threads)
+      thread.join();
+    Threads.clear();
+    Count = 1;
+    Pool = nullptr;
+  }
+
+  int Size() const
+  {
+    return Count;
+  }
+
+  // NUMA node of a member; 0 when the team is not pinned
+  int Node(int thread) const
+  {
+    return Topology ? Topology->NodeOfThread(thread, Count) : 0;
+  }
+
+  int NodeCount() const
+  {
+    return Topology ? Topology->NodeCount() : 1;
+  }
+
+  // Members pinned to a node are numbered consecutively
+  void NodeMembers(int node, int& first, int& count) const
+  {
+    first = 0;
+    while (first < Count && Node(first) != node)
+      first++;
+    count = 0;
+    while (first + count < Count && Node(first + count) == node)
+      count++;
+  }
+
+  void Run(const Task& task)
+  {
+    if (Topology && !PinsCaller)
+    {
+      NumaTopology::Affinity previous = Topology->Pin(0, Count);
+      RunMembers(task);
+      NumaTopology::Restore(previous);
+    }
+    else
+    {
+      RunMembers(task);
+    }
+  }
+
+private:
+  int Count = 1;
+  const NumaTopology* Topology = nullptr;
+  bool PinsCaller = false;
+  Scheduler* Pool = nullptr;
+  std::vector<std::thread> Threads;
+  std::mutex Mutex;
+  std::condition_variable Started;
+  std::condition_variable Finished;
+  const Task* Current = nullptr;
+  int Pending = 0;
+  unsigned Generation = 0;
+  bool ShouldExit = false;
+
+  void RunMembers(const Task& task)
+  {
+    if (Count == 1)
+    {
+      task(0);
+      return;
+    }
+    if (Pool)
+    {
+      Pool->Share(Count, task);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Current = &task;
+      Pending = Count - 1;
+      Generation++;
+    }
+    Started.notify_all();
+    task(0);
+    std::unique_lock<std::mutex> lock(Mutex);
+    Finished.wait(lock, [this]() { return Pending == 0; });
+    Current = nullptr;
+  }
+
+  void Work(int thread, unsigned seen)
+  {
+    for (;;)
+    {
+      const Task* task;
+      {
+        std::unique_lock<std::mutex> lock(Mutex);
+        Started.wait(lock, [&]() { return ShouldExit || Generation != seen; });
+        if (ShouldExit)
+          return;
+        seen = Generation;
+        task = Current;
+      }
+      (*task)(thread);
+      {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (--Pending == 0)
+          Finished.notify_one();
+      }
+    }
+  }
+};
+
+// Writes every chunk of the arena from a member of node (chunk % node count),
+// which spreads the pages round robin over the nodes of a pinned team
+inline void InterleaveChunks(ThreadTeam& team, const Arena& arena)
+{
+  team.Run([&](int thread)
+  {
+    int node = team.Node(thread);
+    int first, count;
+    team.NodeMembers(node, first, count);
+    int chunk = 0;
+    arena.ForEachChunk([&](char* data, size_t size)
+    {
+      if (chunk % team.NodeCount() == node && chunk / team.NodeCount() % count == thread - first)
+        memset(data, 0, size);
+      chunk++;
+    });
+  });
+}
@@ -1,6 +1,28 @@
 #pragma once
 
 #include <array>
+#include <cmath>
+
+// Calls f(I), f(I + 1), ..., f(End - 1) with the loop unrolled at compile time,
+// so that every coordinate gets its own instructions whatever the dimension
+template<int I, int End>
+struct Unroll
+{
+  template<typename F>
+  static inline void Apply(F& f)
+  {
+    f(I);
+    Unroll<I + 1, End>::Apply(f);
+  }
+};
+
+template<int End>
+struct Unroll<End, End>
+{
+  template<typename F>
+  static inline void Apply(F&)
+  {}
+};
 
 template<typename Number, int Dim>
 struct Vector
@@ -10,37 +32,37 @@ struct Vector
     : Data{}
   {}
 
-  Number LengthSquared()
+  Number LengthSquared() const
   {
     Number result{};
-    for (auto d : Data)
-      result += d * d;
+    auto f = [&](int i) { result += Data[i] * Data[i]; };
+    Unroll<0, Dim>::Apply(f);
     return result;
   }
 
-  Number Length()
+  Number Length() const
   {
     return sqrt(LengthSquared());
   }
 
-  inline Vector<Number, Dim> operator += (const Vector<Number, Dim>& other)
+  inline Vector<Number, Dim>& operator += (const Vector<Number, Dim>& other)
   {
-    for (int i = 0; i < Dim; i++)
-      Data[i] += other.Data[i];
+    auto f = [&](int i) { Data[i] += other.Data[i]; };
+    Unroll<0, Dim>::Apply(f);
     return *this;
   }
 
-  inline Vector<Number, Dim> operator -= (const Vector<Number, Dim>& other)
+  inline Vector<Number, Dim>& operator -= (const Vector<Number, Dim>& other)
   {
-    for (int i = 0; i < Dim; i++)
-      Data[i] -= other.Data[i];
+    auto f = [&](int i) { Data[i] -= other.Data[i]; };
+    Unroll<0, Dim>::Apply(f);
     return *this;
   }
 
-  inline Vector<Number, Dim> operator *= (Number k)
+  inline Vector<Number, Dim>& operator *= (Number k)
   {
-    for (int i = 0; i < Dim; i++)
-      Data[i] *= k;
+    auto f = [&](int i) { Data[i] *= k; };
+    Unroll<0, Dim>::Apply(f);
     return *this;
   }
 };
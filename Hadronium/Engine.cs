@@ -1,4 +1,6 @@
 ﻿using System;
+using System.Collections.Generic;
+using System.IO;
 using System.Runtime.InteropServices;
 using System.Windows;
 
@@ -6,6 +8,12 @@ namespace Hadronium
 {
     class Engine
     {
+        static Engine()
+        {
+            var directory = Path.Combine(Environment.GetFolderPath(Environment.SpecialFolder.LocalApplicationData), "Hadronium", "LayoutCache");
+            LayoutCacheOpen(directory, 256L << 20);
+        }
+
         public Engine()
         {
             parameters.In.Viscosity = 10;
@@ -17,9 +25,26 @@ namespace Hadronium
             parameters.In.Gravity = 0;
             parameters.In.Accuracy = 50;
             parameters.In.TimeScale = 1;
+            parameters.In.TimeStepLevels = 0;
+            parameters.In.ThreadCount = 1;
+            parameters.In.MemoryPlacement = 0;
+            parameters.In.Deterministic = 0;
+            parameters.In.FixedTimeStep = 0.001;
+            parameters.In.StepLimit = 0;
+            parameters.In.IdleThreshold = 0.01;
+            parameters.In.IdleWakeInterval = 1;
+            parameters.In.LayoutAlgorithm = 0;
+            parameters.In.StressPivots = 50;
             parameters.Out.StepElapsedTime = 0; // in msec
             parameters.Out.RealTimeScale = 1;
             parameters.Out.StepCount = 0;
+            parameters.Out.SyncLatency = 0;
+            parameters.Out.StepJitter = 0;
+            parameters.Out.IdleTime = 0;
+            parameters.Out.PotentialEnergy = 0;
+            parameters.Out.KineticEnergy = 0;
+            parameters.Out.MaxResidual = 0;
+            parameters.Out.RmsResidual = 0;
         }
 
         [StructLayout(LayoutKind.Sequential)]
@@ -37,9 +62,22 @@ namespace Hadronium
             public bool Fixed;
         }
 
+        [StructLayout(LayoutKind.Sequential)]
+        public struct CacheStatistics
+        {
+            public long Hits;
+            public long NearHits;
+            public long Misses;
+            public long Stores;
+            public long Evictions;
+            public long EntryCount;
+            public long Bytes;
+        }
+
         private double[] particleData;
         private ParticleInfo[] particleInfos;
         private Link[] links;
+        private long[] particleIds;
 
         [StructLayout(LayoutKind.Sequential)]
         public struct Parameters
@@ -56,6 +94,16 @@ namespace Hadronium
                 public double Gravity;
                 public double Accuracy;
                 public double TimeScale;
+                public double TimeStepLevels;
+                public double ThreadCount; // 0 = the idle threads of the engine pool; read at start
+                public double MemoryPlacement; // NumaPlacement; read at start
+                public double Deterministic;
+                public double FixedTimeStep; // simulated seconds per step in deterministic mode
+                public double StepLimit; // 0 = unlimited
+                public double IdleThreshold; // 0 = never idle
+                public double IdleWakeInterval; // in sec, 0 = until input
+                public double LayoutAlgorithm; // 0 = force simulation, 1 = sparse stress
+                public double StressPivots;
             }
             [StructLayout(LayoutKind.Sequential)]
             public struct Output
@@ -63,6 +111,13 @@ namespace Hadronium
                 public double StepElapsedTime; // in msec
                 public double RealTimeScale;
                 public long StepCount;
+                public double SyncLatency;
+                public double StepJitter;
+                public double IdleTime; // in sec
+                public double PotentialEnergy;
+                public double KineticEnergy;
+                public double MaxResidual;
+                public double RmsResidual;
             }
             public Input In;
             public Output Out;
@@ -70,10 +125,24 @@ namespace Hadronium
 
         public Parameters parameters;
 
+        [StructLayout(LayoutKind.Sequential)]
+        public struct MemoryFootprint
+        {
+            public long Used;
+            public long Reserved;
+            public long LargePages;
+        }
+
+        // Highest dimension the native engine is built for; Start throws above it
+        public const int MaxDimension = 64;
+
         private IntPtr handle = IntPtr.Zero;
+        private double priority = 1;
+        private double stepRateLimit = 0;
 
         public void Start(Model model)
         {
+            CheckDimension(model.Dimension);
             particleData = new double[model.Particles.Count * model.Dimension * 2];
             particleInfos = new ParticleInfo[model.Particles.Count];
             links = new Link[model.Links.Count];
@@ -88,17 +157,141 @@ namespace Hadronium
             for (int i = 0; i < model.Particles.Count; i++)
                 particleInfos[i].Mass = model.Particles[i].Mass;
 
+            particleIds = new long[model.Particles.Count];
+            bool named = false;
+            for (int i = 0; i < model.Particles.Count; i++)
+            {
+                particleIds[i] = ParticleId(model.Particles[i], i);
+                named |= !String.IsNullOrEmpty(model.Particles[i].Name);
+            }
+
+            var particleIndices = new Dictionary<Particle, int>(model.Particles.Count);
+            for (int i = 0; i < model.Particles.Count; i++)
+                particleIndices[model.Particles[i]] = i;
             for (int i = 0; i < model.Links.Count; i++)
             {
-                links[i].A = model.GetParticleIndex(model.Links[i].A);
-                links[i].B = model.GetParticleIndex(model.Links[i].B);
+                links[i].A = particleIndices[model.Links[i].A];
+                links[i].B = particleIndices[model.Links[i].B];
                 links[i].Strength = model.Links[i].Strength;
             }
 
             handle = EngineStart(ref parameters, model.Dimension,
               particleData.Length, particleData,
               particleInfos.Length, particleInfos,
-              links.Length, links);
+              links.Length, links,
+              named ? particleIds : null);
+            EngineSetPriority(handle, priority);
+            EngineSetStepRateLimit(handle, stepRateLimit);
+        }
+
+        // Starts on a graph file loaded by the engine itself: a binary CSR file or a
+        // text edge list. Particles are not mirrored in a model; Read gets their state.
+        public void StartFromFile(string path, int dimension)
+        {
+            CheckDimension(dimension);
+            long particleCount, linkCount;
+            handle = EngineStartFromFile(ref parameters, dimension, path, out particleCount, out linkCount);
+            particleData = new double[particleCount * dimension * 2];
+            particleInfos = new ParticleInfo[particleCount];
+            links = null;
+            particleIds = new long[particleCount];
+            EngineParticleIds(handle, particleIds);
+            EngineSetPriority(handle, priority);
+            EngineSetStepRateLimit(handle, stepRateLimit);
+        }
+
+        private static void CheckDimension(int dimension)
+        {
+            if (dimension < 1 || dimension > MaxDimension)
+                throw new ArgumentOutOfRangeException("dimension", dimension, string.Format("The engine supports 1 to {0} dimensions", MaxDimension));
+        }
+
+        // Node ids of the particles, as given to Start or found in the file
+        public long[] ParticleIds
+        {
+            get { return particleIds; }
+        }
+
+        // Positions and velocities of all particles, dimension * 2 values each
+        public double[] Read()
+        {
+            EngineSync(handle, ref parameters, particleData.Length, ref particleData, particleInfos.Length, particleInfos);
+            return particleData;
+        }
+
+        // Level-of-detail sync: only the listed particles are fixed, and only those
+        // inside the box come back, as indices and data. Returns how many are in the
+        // box, which may be more than fit.
+        public long SyncRegion(Box box, long[] fixedIndices, double[] fixedData, long[] indices, double[] data)
+        {
+            return EngineSyncRegion(handle, ref parameters, BoxData(box),
+                fixedIndices.Length, fixedIndices, fixedData,
+                indices.Length, indices, data);
+        }
+
+        // Same as SyncRegion, but the particles in the box are merged into at most
+        // maxClusters clusters: mean position and particle count of each. Returns the
+        // number of clusters.
+        public long SyncClusters(Box box, long[] fixedIndices, double[] fixedData, long maxClusters, double[] clusterData)
+        {
+            return EngineSyncClusters(handle, ref parameters, BoxData(box),
+                fixedIndices.Length, fixedIndices, fixedData,
+                maxClusters, clusterData);
+        }
+
+        private static double[] BoxData(Box box)
+        {
+            var result = new double[box.P1.Length * 2];
+            box.P1.CopyTo(result, 0);
+            box.P2.CopyTo(result, box.P1.Length);
+            return result;
+        }
+
+        // Share of the process-wide engine pool relative to the other engines
+        public double Priority
+        {
+            get { return priority; }
+            set
+            {
+                priority = value;
+                if (Active)
+                    EngineSetPriority(handle, priority);
+            }
+        }
+
+        // Steps per second, 0 = unlimited
+        public double StepRateLimit
+        {
+            get { return stepRateLimit; }
+            set
+            {
+                stepRateLimit = value;
+                if (Active)
+                    EngineSetStepRateLimit(handle, stepRateLimit);
+            }
+        }
+
+        // Identifies a particle across runs for the layout cache: a hash of the name,
+        // or the index for unnamed particles. A model without names passes no ids,
+        // which limits the cache to exact matches.
+        private static long ParticleId(Particle particle, int index)
+        {
+            if (String.IsNullOrEmpty(particle.Name))
+                return index;
+            ulong hash = 14695981039346656037;
+            foreach (var c in particle.Name)
+                hash = (hash ^ c) * 1099511628211;
+            return (long)hash;
+        }
+
+        public static CacheStatistics LayoutCacheStats
+        {
+            get
+            {
+                var result = new CacheStatistics();
+                LayoutCacheStatistics(ref result);
+                return result;
+            }
         }
 
         public void Stop()
@@ -117,6 +310,17 @@ namespace Hadronium
             get { return Active ? EngineStepCount(handle) : 0; }
         }
 
+        public MemoryFootprint Footprint
+        {
+            get
+            {
+                var result = new MemoryFootprint();
+                if (Active)
+                    EngineMemoryFootprint(handle, ref result);
+                return result;
+            }
+        }
+
         public void Sync(Model model)
         {
             for (int i = 0; i < model.Particles.Count; i++)
@@ -162,9 +366,23 @@ namespace Hadronium
             long particleInfoSize,
             [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 3)] ParticleInfo[] particleInfos,
             long linkCount,
-            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 5)] Link[] links
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 5)] Link[] links,
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 3)] long[] particleIds
             );
 
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern IntPtr EngineStartFromFile(
+            ref Parameters parameters,
+            int dimension,
+            [MarshalAs(UnmanagedType.LPWStr)] string path,
+            out long particleCount,
+            out long linkCount);
+
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern void EngineParticleIds(
+            IntPtr engine,
+            [Out] long[] particleIds);
+
         [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
         static extern void EngineSync(
             IntPtr engine,
@@ -174,13 +392,61 @@ namespace Hadronium
             long particleInfoSize,
             [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 4)] ParticleInfo[] particleInfos);
 
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern long EngineSyncRegion(
+            IntPtr engine,
+            ref Parameters parameters,
+            double[] box,
+            long fixedCount,
+            long[] fixedIndices,
+            double[] fixedData,
+            long capacity,
+            [Out] long[] indices,
+            [Out] double[] particleData);
+
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern long EngineSyncClusters(
+            IntPtr engine,
+            ref Parameters parameters,
+            double[] box,
+            long fixedCount,
+            long[] fixedIndices,
+            double[] fixedData,
+            long maxClusters,
+            [Out] double[] clusterData);
+
         [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
         static extern long EngineStepCount(
             IntPtr engine);
 
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern void EngineMemoryFootprint(
+            IntPtr engine,
+            ref MemoryFootprint footprint);
+
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern void EngineSetPriority(
+            IntPtr engine,
+            double priority);
+
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern void EngineSetStepRateLimit(
+            IntPtr engine,
+            double stepsPerSecond);
+
         [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
         static extern void EngineStop(
             IntPtr engine);
 
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        static extern bool LayoutCacheOpen(
+            [MarshalAs(UnmanagedType.LPWStr)] string directory,
+            long maxBytes);
+
+        [DllImport("Engine.dll", CallingConvention = CallingConvention.Cdecl)]
+        static extern void LayoutCacheStatistics(
+            ref CacheStatistics statistics);
+
     }
 }
@@ -36,6 +36,7 @@ namespace Hadronium
             new PropertyDescription(SourceKind.Model, "Gravity"           ,   0.0, -1E3, 1E3, new BiLogarithmicConverter(1)),
             new PropertyDescription(SourceKind.Model, "Viscosity"         ,  10.0,  0.0, 1000.0, new LogarithmicConverter()),
             new PropertyDescription(SourceKind.Model, "Accuracy"          ,  50.0,  0.1,  1E5, new LogarithmicConverter()),
+            new PropertyDescription(SourceKind.Model, "TimeStepLevels"    ,   0.0,  0.0, 16.0),
         };
         private static PropertyDescription[] controlPropertyDescriptions = new PropertyDescription[] { 
             new PropertyDescription(SourceKind.View, "Rotation"          ,   0.0, -180.0, 180.0),
@@ -48,6 +49,9 @@ namespace Hadronium
             new PropertyDescription(SourceKind.Model, "StepCount"         ,   1.0, 0.001, 1E5),
             new PropertyDescription(SourceKind.Model, "StepElapsedTime"   ,   1.0, 0.001, 1E5,  new LogarithmicConverter()),
             new PropertyDescription(SourceKind.Model, "RealTimeScale"     ,   1.0, 0.01, 1000.0, new LogarithmicConverter()),
+            new PropertyDescription(SourceKind.Model, "IdleTime"          ,   0.0, 0.0, 1E5),
+            new PropertyDescription(SourceKind.Model, "KineticEnergy"     ,   1.0, 1E-5, 1E10, new LogarithmicConverter()),
+            new PropertyDescription(SourceKind.Model, "RmsResidual"       ,   1.0, 1E-5, 1E10, new LogarithmicConverter()),
             new PropertyDescription(SourceKind.View, "RenderElapsedTime" ,   1.0, 1E-5, 1E5,  new LogarithmicConverter())
         };
 
@@ -184,6 +188,9 @@ namespace Hadronium
                 }
                 ModelRecreated();
             };
+            // The engines of all open windows share one pool; the foreground one gets more of it
+            Activated += delegate { model.Priority = 4; };
+            Deactivated += delegate { model.Priority = 1; };
         }
 
 
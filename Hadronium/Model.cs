@@ -221,6 +221,78 @@ namespace Hadronium
             set { setProperty("TimeScale", ref engine.parameters.In.TimeScale, value); }
         }
 
+        public double TimeStepLevels
+        {
+            get { return engine.parameters.In.TimeStepLevels; }
+            set { setProperty("TimeStepLevels", ref engine.parameters.In.TimeStepLevels, value); }
+        }
+
+        public double ThreadCount
+        {
+            get { return engine.parameters.In.ThreadCount; }
+            set { setProperty("ThreadCount", ref engine.parameters.In.ThreadCount, value); }
+        }
+
+        public double MemoryPlacement
+        {
+            get { return engine.parameters.In.MemoryPlacement; }
+            set { setProperty("MemoryPlacement", ref engine.parameters.In.MemoryPlacement, value); }
+        }
+
+        public double Deterministic
+        {
+            get { return engine.parameters.In.Deterministic; }
+            set { setProperty("Deterministic", ref engine.parameters.In.Deterministic, value); }
+        }
+
+        public double FixedTimeStep
+        {
+            get { return engine.parameters.In.FixedTimeStep; }
+            set { setProperty("FixedTimeStep", ref engine.parameters.In.FixedTimeStep, value); }
+        }
+
+        public double StepLimit
+        {
+            get { return engine.parameters.In.StepLimit; }
+            set { setProperty("StepLimit", ref engine.parameters.In.StepLimit, value); }
+        }
+
+        public double Priority
+        {
+            get { return engine.Priority; }
+            set { engine.Priority = value; }
+        }
+
+        public double StepRateLimit
+        {
+            get { return engine.StepRateLimit; }
+            set { engine.StepRateLimit = value; }
+        }
+
+        public double LayoutAlgorithm
+        {
+            get { return engine.parameters.In.LayoutAlgorithm; }
+            set { setProperty("LayoutAlgorithm", ref engine.parameters.In.LayoutAlgorithm, value); }
+        }
+
+        public double StressPivots
+        {
+            get { return engine.parameters.In.StressPivots; }
+            set { setProperty("StressPivots", ref engine.parameters.In.StressPivots, value); }
+        }
+
+        public double IdleThreshold
+        {
+            get { return engine.parameters.In.IdleThreshold; }
+            set { setProperty("IdleThreshold", ref engine.parameters.In.IdleThreshold, value); }
+        }
+
+        public double IdleWakeInterval
+        {
+            get { return engine.parameters.In.IdleWakeInterval; }
+            set { setProperty("IdleWakeInterval", ref engine.parameters.In.IdleWakeInterval, value); }
+        }
+
         public long StepCount
         {
             get { return statistics.StepCount; }
@@ -244,6 +316,36 @@ namespace Hadronium
             set { setProperty("RealTimeScale", ref statistics.RealTimeScale, value); }
         }
 
+        public double IdleTime
+        {
+            get { return statistics.IdleTime; }
+            set { setProperty("IdleTime", ref statistics.IdleTime, value); }
+        }
+
+        public double PotentialEnergy
+        {
+            get { return statistics.PotentialEnergy; }
+            set { setProperty("PotentialEnergy", ref statistics.PotentialEnergy, value); }
+        }
+
+        public double KineticEnergy
+        {
+            get { return statistics.KineticEnergy; }
+            set { setProperty("KineticEnergy", ref statistics.KineticEnergy, value); }
+        }
+
+        public double MaxResidual
+        {
+            get { return statistics.MaxResidual; }
+            set { setProperty("MaxResidual", ref statistics.MaxResidual, value); }
+        }
+
+        public double RmsResidual
+        {
+            get { return statistics.RmsResidual; }
+            set { setProperty("RmsResidual", ref statistics.RmsResidual, value); }
+        }
+
         public bool Active
         {
             get { return engine.Active; }
@@ -392,6 +494,11 @@ namespace Hadronium
             StepCount = engine.parameters.Out.StepCount;
             StepElapsedTime = engine.parameters.Out.StepElapsedTime;
             RealTimeScale = engine.parameters.Out.RealTimeScale;
+            IdleTime = engine.parameters.Out.IdleTime;
+            PotentialEnergy = engine.parameters.Out.PotentialEnergy;
+            KineticEnergy = engine.parameters.Out.KineticEnergy;
+            MaxResidual = engine.parameters.Out.MaxResidual;
+            RmsResidual = engine.parameters.Out.RmsResidual;
         }
     }
 }